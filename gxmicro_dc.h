@@ -10,23 +10,43 @@
 #ifndef __GXMICRO_DC_H__
 #define __GXMICRO_DC_H__
 
+#include <linux/module.h>
 #include <linux/pci.h>
+#include <linux/interrupt.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
 #include <linux/i2c-algo-bit.h>
 #include <drm/drm_device.h>
 #include <drm/drm_plane.h>
 #include <drm/drm_crtc.h>
 #include <drm/drm_encoder.h>
 #include <drm/drm_connector.h>
+#include <drm/drm_rect.h>
 #include <drm/drm_gem_vram_helper.h>
 #include <linux/bits.h>
+#include <linux/bitmap.h>
 #include <linux/sizes.h>
 
 /* ****************************** DDR ****************************** */
 
+#define GXMICRO_FB_BAR				0	/* VRAM */
+
 /* DDR 起始地址, FrameBuffer 和 Cursor 使用, 用于设置 JPEG 寄存器 */
 #define FB_CUR_BASE				0x80000000
 #define FB_CUR_OFFSET(offset)			(FB_CUR_BASE + offset)
 
+/*
+ * VRAM (BAR 0) 布局
+ * 	[0, vram_size)				TTM 管理, FrameBuffer
+ * 	[jpeg_offset, + JPEG_RESERVED)		JPEG bitstream, 显存不足时不保留
+ * 	[cursor_offset, + CURSOR_RESERVED)	Cursor
+ */
+#define CURSOR_SLOTS				4
+#define CURSOR_RESERVED				(CURSOR_SIZE * CURSOR_SLOTS)
+#define JPEG_BS_SIZE				SZ_2M
+#define JPEG_RESERVED				(JPEG_BS_SIZE * JPEG_BUFFERS)
+#define VRAM_FB_MIN_SIZE			(DISPLAY_WIDTH * DISPLAY_HEIGHT * 4 * 2)	/* 1080p XRGB8888 双缓冲 */
+
 /* ****************************** PMU Controller ****************************** */
 
 #define PMU_BASE				0x006b0000
@@ -90,43 +110,30 @@
 #define CURSOR_HEIGHT				32
 #define CURSOR_SIZE				SZ_4K	/* CURSOR_WIDTH * CURSOR_HEIGHT * 4 = SZ_4K */
 
-/* Registers offset for Display 0 */
-#define DC_CTRL					DC_OFFSET(0x1240)
-#define DC_ADDR0				DC_OFFSET(0x1260)
-#define DC_ADDR1				DC_OFFSET(0x1580)
-#define DC_STRIDE				DC_OFFSET(0x1280)
-#define DC_ORIGIN				DC_OFFSET(0x12a0)
-#define DC_DITHER_CONF				DC_OFFSET(0x1360)
-#define DC_DITHER_TABLE_LOW			DC_OFFSET(0x1380)
-#define DC_DITHER_TABLE_HIGH			DC_OFFSET(0x13a0)
-#define DC_PANEL_CONF				DC_OFFSET(0x13c0)
-#define DC_PANEL_TIMING				DC_OFFSET(0x13e0)
-#define DC_HDISPLAY				DC_OFFSET(0x1400)
-#define DC_HSYNC				DC_OFFSET(0x1420)
-#define DC_VDISPLAY				DC_OFFSET(0x1480)
-#define DC_VSYNC				DC_OFFSET(0x14a0)
-#define DC_GAMMA_INDEX				DC_OFFSET(0x14e0)
-#define DC_GAMMA_DATA				DC_OFFSET(0x1500)
-
-#if 0
-/* Registers offset for Display 1 */
-#define DC_FB1_CONF				DC_OFFSET(0x1250)
-#define DC_FB1_ADDR0				DC_OFFSET(0x1270)
-#define DC_FB1_ADDR1				DC_OFFSET(0x1590)
-#define DC_FB1_STRIDE				DC_OFFSET(0x1290)
-#define DC_FB1_ORIGIN				DC_OFFSET(0x12b0)
-#define DC_FB1_DITHER_CONF			DC_OFFSET(0x1370)
-#define DC_FB1_DITHER_TABLE_LOW			DC_OFFSET(0x1390)
-#define DC_FB1_DITHER_TABLE_HIGH		DC_OFFSET(0x13b0)
-#define DC_FB1_PANEL_CONF			DC_OFFSET(0x13d0)
-#define DC_FB1_PANEL_TIMING			DC_OFFSET(0x13f0)
-#define DC_FB1_HDISPLAY				DC_OFFSET(0x1410)
-#define DC_FB1_HSYNC				DC_OFFSET(0x1430)
-#define DC_FB1_VDISPLAY				DC_OFFSET(0x1490)
-#define DC_FB1_VSYNC				DC_OFFSET(0x14b0)
-#define DC_FB1_GAMMA_INDEX			DC_OFFSET(0x14f0)
-#define DC_FB1_GAMMA_DATA			DC_OFFSET(0x1510)
-#endif
+/*
+ * Registers offset for Display 0 & 1
+ * 	Display 1 (DC_FB1_*) 的寄存器为 Display 0 + DC_PIPE_STRIDE
+ */
+#define DC_PIPES				2
+#define DC_PIPE_STRIDE				0x10
+#define DC_PIPE_OFFSET(pipe, offset)		DC_OFFSET((offset) + (pipe) * DC_PIPE_STRIDE)
+
+#define DC_CTRL(pipe)				DC_PIPE_OFFSET(pipe, 0x1240)
+#define DC_ADDR0(pipe)				DC_PIPE_OFFSET(pipe, 0x1260)
+#define DC_ADDR1(pipe)				DC_PIPE_OFFSET(pipe, 0x1580)
+#define DC_STRIDE(pipe)				DC_PIPE_OFFSET(pipe, 0x1280)
+#define DC_ORIGIN(pipe)				DC_PIPE_OFFSET(pipe, 0x12a0)
+#define DC_DITHER_CONF(pipe)			DC_PIPE_OFFSET(pipe, 0x1360)
+#define DC_DITHER_TABLE_LOW(pipe)		DC_PIPE_OFFSET(pipe, 0x1380)
+#define DC_DITHER_TABLE_HIGH(pipe)		DC_PIPE_OFFSET(pipe, 0x13a0)
+#define DC_PANEL_CONF(pipe)			DC_PIPE_OFFSET(pipe, 0x13c0)
+#define DC_PANEL_TIMING(pipe)			DC_PIPE_OFFSET(pipe, 0x13e0)
+#define DC_HDISPLAY(pipe)			DC_PIPE_OFFSET(pipe, 0x1400)
+#define DC_HSYNC(pipe)				DC_PIPE_OFFSET(pipe, 0x1420)
+#define DC_VDISPLAY(pipe)			DC_PIPE_OFFSET(pipe, 0x1480)
+#define DC_VSYNC(pipe)				DC_PIPE_OFFSET(pipe, 0x14a0)
+#define DC_GAMMA_INDEX(pipe)			DC_PIPE_OFFSET(pipe, 0x14e0)
+#define DC_GAMMA_DATA(pipe)			DC_PIPE_OFFSET(pipe, 0x1500)
 
 /* Registers offset for Cursor */
 #define DC_CURSOR_CTRL				DC_OFFSET(0x1520)
@@ -149,9 +156,11 @@
 
 /* FrameBuffer Configuration */
 #define RESET_DC_CTRL				BIT(20)
-#define GAMMA_ENABLE				BIT(12)	/* 非必须, 未测试, 当前无法读 Gamma 相关寄存器 */
+#define GAMMA_ENABLE				BIT(12)	/* 无法读 Gamma 表, 驱动保存副本 */
+#define DC_FB_INDEX				BIT(11)	/* 只读, 0: 正在扫描 DC_ADDR0, 1: 正在扫描 DC_ADDR1 */
 #define SWITCH_PANEL				BIT(9)
 #define OUTPUT_ENABLE				BIT(8)
+#define DC_PAGE_FLIP				BIT(7)	/* 下一帧开始时切换到另一个地址寄存器, 自动清除 */
 #define DC_FB_FORMAT				GENMASK(2, 0)
 # define DC_RGB888				BIT(2)
 # define DC_RGB565				GENMASK(1, 0)
@@ -168,6 +177,13 @@
 #define DE					BIT(0)
 #define PANEL_CONF				(HWSEQ | CLOCK_POLARITY | CLOCK | DE)
 
+/* Interrupt & Interrupt Enable, 两个寄存器 bit 相同, Interrupt 写 1 清除 */
+#define DC_INT_FB1_VSYNC			BIT(0)
+#define DC_INT_FB1_HSYNC			BIT(1)
+#define DC_INT_FB0_VSYNC			BIT(2)
+#define DC_INT_FB0_HSYNC			BIT(3)
+#define DC_INT_VSYNC(pipe)			((pipe) ? DC_INT_FB1_VSYNC : DC_INT_FB0_VSYNC)
+
 /* HVDisplay & HVSync  */
 #define HVDISPLAY_TOTAL(t)			(((t) & 0xfff) << 16)
 #define HVDISPLAY_END(e)			((e) & 0xfff)
@@ -178,7 +194,7 @@
 #define HVSYNC_START(s)				((s) & 0xfff)
 #define HVSYNC(s, e)				(PULSE_ENABLE | HVSYNC_END(e) | HVSYNC_START(s))
 
-/* Gamma Data */ /* 非必须, 未测试, 当前无法读 Gamma 相关寄存器 */
+/* Gamma Data, 写 DC_GAMMA_INDEX 后连续写 DC_GAMMA_DATA, 索引自动增加 */
 #define GAMMA_SIZE				SZ_256
 #define GAMMA_RED(r)				(((r) & 0xff00) << 8)
 #define GAMMA_GREEN(g)				((g) & 0xff00)
@@ -188,7 +204,7 @@
 /* Cursor Configuration */
 #define CURSOR_HOTSPOT_X(x)			(((x) & 0x1f) << 16)
 #define CURSOR_HOTSPOT_Y(y)			(((y) & 0x1f) << 8)
-#define CURSOR_DISPLAY				BIT(4)	/* Always in FB 0 */
+#define CURSOR_DISPLAY				BIT(4)	/* Always in FB 0, 只属于 pipe 0 */
 #define CURSOR_FORMAT				GENMASK(1, 0)
 # define CUR_ARGB8888				BIT(1)
 /*
@@ -278,40 +294,264 @@
 #define JPEG_EOF				BIT(0)
 #define JPEG_INTR_CLEAN				(JPEG_BS_OVERFLOW | JPEG_EOF)
 
+/* ****************************** Register Shadow ****************************** */
+
+/*
+ * 驱动维护的寄存器副本 (见 Display Controller 说明)
+ * 	1. 写: 与副本相同时不写 MMIO
+ * 	2. 读: 副本有效时不读 MMIO, 只有第一次读取访问硬件
+ * 不在副本中的寄存器: 中断状态, Gamma 索引/数据端口, GPIO 输入, JPEG
+ */
+#define SHADOW_DC_START				DC_CTRL(0)
+#define SHADOW_DC_END				(DC_INTERRUPT_ENABLE + 4)
+#define SHADOW_GPIOA_START			GPIOA_PORTA_DR
+#define SHADOW_GPIOA_END			(GPIOA_PORTD_CTRL + 4)
+#define SHADOW_PMU_START			PMU_RCU_CPU_RSTR
+#define SHADOW_PMU_END				(PMU_RCU_AHB_ENR + 4)
+
+#define SHADOW_DC_REGS				((SHADOW_DC_END - SHADOW_DC_START) / 4)
+#define SHADOW_GPIOA_REGS			((SHADOW_GPIOA_END - SHADOW_GPIOA_START) / 4)
+#define SHADOW_PMU_REGS				((SHADOW_PMU_END - SHADOW_PMU_START) / 4)
+#define SHADOW_REGS				(SHADOW_DC_REGS + SHADOW_GPIOA_REGS + SHADOW_PMU_REGS)
+
+/* 扫描 FrameBuffer 的额外 pin, JPEG 编码期间不会被移动或释放 */
+struct gxmicro_scanout_ref {
+	struct kref ref;
+	struct drm_gem_object *obj;
+	struct work_struct work;	/* 最后一次 put 可能在中断中, unpin 需要睡眠 */
+};
+
+/* JPEG 编码源, jpeg_pipe 的 primary plane 当前扫描的 FrameBuffer */
+struct gxmicro_scanout {
+	uint64_t addr;		/* VRAM 偏移 */
+	uint32_t format;	/* DRM_FORMAT_*, 0: 未扫描 */
+	uint32_t cpp;
+	uint32_t width;
+	uint32_t height;
+	uint32_t pitch;
+	struct gxmicro_scanout_ref *ref;
+};
+
+/* Gamma 表, 硬件读取不可靠, 驱动保存已写入的副本, gamma_lock 保护 */
+struct gxmicro_gamma {
+	uint32_t hw[GAMMA_SIZE];	/* 已写入硬件 */
+	uint32_t next[GAMMA_SIZE];	/* 下一个 vblank 写入 */
+	bool hw_valid;			/* false: 硬件内容未知, 全部写入 */
+	bool pending;			/* 持有 vblank 引用 */
+};
+
+struct gxmicro_jpeg;
+
 struct gxmicro_dc_dev {
 	struct drm_device *dev;
-	struct drm_plane *primary;
+	/* pipe 0: 显示器 (DDC), pipe 1: 虚拟输出; Cursor 只在 pipe 0 */
+	struct drm_plane primary[DC_PIPES];
 	struct drm_plane cursor;
-	struct drm_crtc crtc;
-	struct drm_encoder encoder;
-	struct drm_connector connector;
+	struct drm_crtc crtc[DC_PIPES];
+	struct drm_encoder encoder[DC_PIPES];
+	struct drm_connector connector[DC_PIPES];
 
 	struct i2c_adapter adap;
 	struct i2c_algo_bit_data algo;
 	struct i2c_client *sil9134;
+	struct edid *edid;	/* 缓存, mode_config.mutex 保护 */
+	struct delayed_work hpd_work;
+	enum drm_connector_status hpd_status;
 
 	void __iomem *mmio;
 
-	uint32_t dctrl;
+	resource_size_t vram_base;
+	resource_size_t vram_size;		/* TTM 管理部分 */
+	resource_size_t cursor_offset;
+	resource_size_t jpeg_offset;		/* 0: 未保留 */
+
+	void __iomem *cursor_vaddr;		/* CURSOR_SLOTS 个槽, write-combine */
+	uint32_t cursor_copy;			/* 最后复制的槽 */
+
+	spinlock_t cursor_lock;			/* vblank 时写入的 Cursor 寄存器 */
+	bool cursor_pending;
+	uint32_t cursor_slot;
+	uint32_t cursor_scan;			/* 已写入 DC_CURSOR_ADDR 的槽 */
+	uint32_t cursor_ctrl;
+	uint32_t cursor_loc;
+
+	uint32_t shadow[SHADOW_REGS];
+	DECLARE_BITMAP(shadow_valid, SHADOW_REGS);
+
+	int32_t fb_index[DC_PIPES];	/* DC_FB_INDEX, vblank 中断中更新, -1: modeset 后未同步 */
+
+	spinlock_t gamma_lock;
+	struct gxmicro_gamma gamma[DC_PIPES];
+
+	spinlock_t damage_lock;
+	struct drm_rect damage;	/* JPEG 源 primary plane 累计 damage, 扫描坐标 */
+
+	spinlock_t scanout_lock;
+	struct gxmicro_scanout scanout;
+	/* 更新 scanout 和 pin, 不在中断中 */
+	struct mutex scanout_mutex;
+	struct drm_framebuffer *scanout_fb;	/* 正在扫描, 由 plane state 持有, 不增加引用 */
+	bool scanout_pin;			/* JPEG 有用户时 pin FrameBuffer */
+
+	struct gxmicro_jpeg *jpeg;	/* NULL: 未启用, scanout_lock 中清除 */
 };
 
-static inline uint32_t gxmicro_read(struct gxmicro_dc_dev *gdev, uint32_t reg)
+/*
+ * 副本没有锁, 每个寄存器只能由一个上下文读-改-写 (gxmicro_update_bits), 新增写者时需确认
+ * 	DC_CTRL, 时序, 地址:		atomic commit (进程上下文, 按 crtc 串行)
+ * 	DC_INTERRUPT_ENABLE:		enable/disable_vblank, drm vbl_lock 中
+ * 	DC_CURSOR_*:			cursor_lock 中 (commit 和 vblank 中断)
+ * 	GPIOA:				i2c adapter 锁中
+ * 	PMU:				probe
+ * 中断中只读取 DC_CTRL (__gxmicro_read, 不经过副本)
+ * shadow_valid 使用原子位操作, 不同寄存器可以在不同上下文中写入
+ */
+static inline int gxmicro_shadow_index(uint32_t reg)
+{
+	switch (reg) {
+	case DC_GAMMA_INDEX(0):
+	case DC_GAMMA_INDEX(1):
+	case DC_GAMMA_DATA(0):
+	case DC_GAMMA_DATA(1):
+	case DC_INTERRUPT:
+		return -1;
+	}
+
+	if (reg >= SHADOW_DC_START && reg < SHADOW_DC_END)
+		return (reg - SHADOW_DC_START) / 4;
+	if (reg >= SHADOW_GPIOA_START && reg < SHADOW_GPIOA_END)
+		return SHADOW_DC_REGS + (reg - SHADOW_GPIOA_START) / 4;
+	if (reg >= SHADOW_PMU_START && reg < SHADOW_PMU_END)
+		return SHADOW_DC_REGS + SHADOW_GPIOA_REGS + (reg - SHADOW_PMU_START) / 4;
+
+	return -1;
+}
+
+/* 直接访问 MMIO, 不经过副本 */
+static inline uint32_t __gxmicro_read(struct gxmicro_dc_dev *gdev, uint32_t reg)
 {
 	return ioread32(gdev->mmio + reg);
 }
 
-static inline void gxmicro_write(struct gxmicro_dc_dev *gdev, uint32_t reg, uint32_t val)
+static inline void __gxmicro_write(struct gxmicro_dc_dev *gdev, uint32_t reg, uint32_t val)
 {
 	iowrite32(val, gdev->mmio + reg);
 }
 
+static inline uint32_t gxmicro_read(struct gxmicro_dc_dev *gdev, uint32_t reg)
+{
+	int i = gxmicro_shadow_index(reg);
+
+	if (i < 0)
+		return __gxmicro_read(gdev, reg);
+
+	if (!test_bit(i, gdev->shadow_valid)) {
+		gdev->shadow[i] = __gxmicro_read(gdev, reg);
+		set_bit(i, gdev->shadow_valid);
+	}
+
+	return gdev->shadow[i];
+}
+
+static inline void gxmicro_write(struct gxmicro_dc_dev *gdev, uint32_t reg, uint32_t val)
+{
+	int i = gxmicro_shadow_index(reg);
+
+	if (i >= 0) {
+		if (test_bit(i, gdev->shadow_valid) && gdev->shadow[i] == val)
+			return;
+
+		gdev->shadow[i] = val;
+		set_bit(i, gdev->shadow_valid);
+	}
+
+	__gxmicro_write(gdev, reg, val);
+}
+
+static inline void gxmicro_update_bits(struct gxmicro_dc_dev *gdev, uint32_t reg, uint32_t mask, uint32_t val)
+{
+	gxmicro_write(gdev, reg, (gxmicro_read(gdev, reg) & ~mask) | (val & mask));
+}
+
+/* trigger 为硬件自动清除的位 (如 DC_PAGE_FLIP), 总是写入 MMIO, 副本中不保存 */
+static inline void gxmicro_write_trigger(struct gxmicro_dc_dev *gdev, uint32_t reg, uint32_t val, uint32_t trigger)
+{
+	int i = gxmicro_shadow_index(reg);
+
+	if (i >= 0) {
+		gdev->shadow[i] = val;
+		set_bit(i, gdev->shadow_valid);
+	}
+
+	__gxmicro_write(gdev, reg, val | trigger);
+}
+
+/* 复位后寄存器恢复默认值, 副本失效 */
+static inline void gxmicro_shadow_invalidate(struct gxmicro_dc_dev *gdev, uint32_t start, uint32_t end)
+{
+	bitmap_clear(gdev->shadow_valid, gxmicro_shadow_index(start), (end - start) / 4);
+}
+
+/* 清除 RESET_DC_CTRL 后 pipe 的寄存器可能恢复默认值; DC_CTRL 由驱动刚写入, 仍然有效 */
+static inline void gxmicro_shadow_invalidate_pipe(struct gxmicro_dc_dev *gdev, uint32_t pipe)
+{
+	const uint32_t regs[] = {
+		DC_ADDR0(pipe), DC_ADDR1(pipe), DC_STRIDE(pipe), DC_ORIGIN(pipe),
+		DC_DITHER_CONF(pipe), DC_DITHER_TABLE_LOW(pipe), DC_DITHER_TABLE_HIGH(pipe),
+		DC_PANEL_CONF(pipe), DC_PANEL_TIMING(pipe),
+		DC_HDISPLAY(pipe), DC_HSYNC(pipe), DC_VDISPLAY(pipe), DC_VSYNC(pipe),
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(regs); i++)
+		clear_bit(gxmicro_shadow_index(regs[i]), gdev->shadow_valid);
+}
+
 int gxmicro_i2c_init(struct gxmicro_dc_dev *gdev);
 void gxmicro_i2c_fini(struct gxmicro_dc_dev *gdev);
 
 int gxmicro_ttm_init(struct gxmicro_dc_dev *gdev);
 void gxmicro_ttm_fini(struct gxmicro_dc_dev *gdev);
+void gxmicro_gem_free_object(struct drm_gem_object *obj);
+int gxmicro_gem_prime_pin(struct drm_gem_object *obj);
+void *gxmicro_gem_prime_vmap(struct drm_gem_object *obj);
+void gxmicro_gem_prime_vunmap(struct drm_gem_object *obj, void *vaddr);
+struct drm_gem_object *gxmicro_gem_prime_import(struct drm_device *dev, struct dma_buf *dma_buf);
+int gxmicro_gem_prime_copy(struct drm_framebuffer *fb, const struct drm_rect *rect);
 
 int gxmicro_kms_init(struct gxmicro_dc_dev *gdev);
 void gxmicro_kms_fini(struct gxmicro_dc_dev *gdev);
+void gxmicro_kms_hpd_enable(struct gxmicro_dc_dev *gdev);
+void gxmicro_kms_hpd_disable(struct gxmicro_dc_dev *gdev);
+irqreturn_t gxmicro_kms_irq_handler(struct gxmicro_dc_dev *gdev);
+bool gxmicro_kms_damage_take(struct gxmicro_dc_dev *gdev, struct drm_rect *rect);
+void gxmicro_kms_scanout_get(struct gxmicro_dc_dev *gdev, struct gxmicro_scanout *scanout);
+void gxmicro_kms_scanout_put(struct gxmicro_scanout_ref *ref);
+void gxmicro_kms_scanout_pin(struct gxmicro_dc_dev *gdev, bool pin);
+
+#if IS_ENABLED(CONFIG_DRM_GXMICRO_JPEG)
+int gxmicro_jpeg_init(struct gxmicro_dc_dev *gdev);
+void gxmicro_jpeg_fini(struct gxmicro_dc_dev *gdev);
+irqreturn_t gxmicro_jpeg_irq_handler(struct gxmicro_dc_dev *gdev);
+void gxmicro_jpeg_mode_set(struct gxmicro_dc_dev *gdev);
+#else
+static inline int gxmicro_jpeg_init(struct gxmicro_dc_dev *gdev)
+{
+	return 0;
+}
+
+static inline void gxmicro_jpeg_fini(struct gxmicro_dc_dev *gdev)
+{
+}
+
+static inline irqreturn_t gxmicro_jpeg_irq_handler(struct gxmicro_dc_dev *gdev)
+{
+	return IRQ_NONE;
+}
+
+static inline void gxmicro_jpeg_mode_set(struct gxmicro_dc_dev *gdev)
+{
+}
+#endif
 
 #endif /* __GXMICRO_DC_H__ */
@@ -8,8 +8,10 @@
  * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
  */
 #include <drm/drm_drv.h>
+#include <drm/drm_atomic_helper.h>
 #include <drm/drm_vram_mm_helper.h>
 #include <drm/drm_fb_helper.h>
+#include <drm/drm_prime.h>
 
 #include "gxmicro_dc.h"
 
@@ -41,6 +43,7 @@
 #define dc_reset(gdev) ({ \
 	gxmicro_write(gdev, PMU_RCU_AHB_RSTR, gxmicro_read(gdev, PMU_RCU_AHB_RSTR) & ~RCU_DC);\
 	gxmicro_write(gdev, PMU_RCU_AHB_RSTR, gxmicro_read(gdev, PMU_RCU_AHB_RSTR) | RCU_DC);	\
+	gxmicro_shadow_invalidate(gdev, SHADOW_DC_START, SHADOW_DC_END);			\
 })
 #if 0
 #define dc_reset(gdev) ({ \
@@ -51,6 +54,70 @@
 })
 #endif
 
+static irqreturn_t gxmicro_irq_handler(int irq, void *arg)
+{
+	struct gxmicro_dc_dev *gdev = arg;
+	irqreturn_t ret;
+
+	ret = gxmicro_kms_irq_handler(gdev);
+
+	if (gxmicro_jpeg_irq_handler(gdev) == IRQ_HANDLED)
+		ret = IRQ_HANDLED;
+
+	return ret;
+}
+
+/*
+ * Resizable BAR: 将 VRAM BAR 扩大到设备支持的最大值, CPU 可访问全部 DDR
+ * 需要在 pci_request_regions 之前, 失败时保持原大小
+ */
+static void gxmicro_pcie_resize_bar(struct pci_dev *pdev)
+{
+	uint32_t cap = 0;
+	uint32_t ctrl;
+	uint16_t cmd;
+	int pos, nbars, i;
+	int size, cur = 0;
+	int ret;
+
+	pos = pci_find_ext_capability(pdev, PCI_EXT_CAP_ID_REBAR);
+	if (!pos)
+		return;
+
+	pci_read_config_dword(pdev, pos + PCI_REBAR_CTRL, &ctrl);
+	nbars = (ctrl & PCI_REBAR_CTRL_NBAR_MASK) >> PCI_REBAR_CTRL_NBAR_SHIFT;
+
+	for (i = 0; i < nbars; i++, pos += 8) {
+		pci_read_config_dword(pdev, pos + PCI_REBAR_CTRL, &ctrl);
+		if ((ctrl & PCI_REBAR_CTRL_BAR_IDX) != GXMICRO_FB_BAR)
+			continue;
+
+		pci_read_config_dword(pdev, pos + PCI_REBAR_CAP, &cap);
+		cur = (ctrl & PCI_REBAR_CTRL_BAR_SIZE) >> PCI_REBAR_CTRL_BAR_SHIFT;
+		break;
+	}
+
+	/* bit 4: 1MB, bit 5: 2MB ... */
+	size = fls((cap & PCI_REBAR_CAP_SIZES) >> 4) - 1;
+	if (size <= cur)
+		return;
+
+	pci_read_config_word(pdev, PCI_COMMAND, &cmd);
+	pci_write_config_word(pdev, PCI_COMMAND, cmd & ~PCI_COMMAND_MEMORY);
+
+	pci_release_resource(pdev, GXMICRO_FB_BAR);
+
+	ret = pci_resize_resource(pdev, GXMICRO_FB_BAR, size);
+	if (ret)
+		pci_warn(pdev, "Failed to resize VRAM BAR to %dMiB, ret %d\n", 1 << size, ret);
+
+	pci_assign_unassigned_bus_resources(pdev->bus);
+
+	pci_write_config_word(pdev, PCI_COMMAND, cmd);
+
+	pci_info(pdev, "VRAM BAR: %pR\n", &pdev->resource[GXMICRO_FB_BAR]);
+}
+
 static int gxmicro_pcie_init(struct pci_dev *pdev)
 {
 	struct gxmicro_dc_dev *gdev = pci_get_drvdata(pdev);
@@ -60,6 +127,8 @@ static int gxmicro_pcie_init(struct pci_dev *pdev)
 	if (ret)
 		return ret;
 
+	gxmicro_pcie_resize_bar(pdev);
+
 	ret = pci_request_regions(pdev, KBUILD_MODNAME);
 	if (ret)
 		goto err_request_regions;
@@ -75,8 +144,29 @@ static int gxmicro_pcie_init(struct pci_dev *pdev)
 	ddr_reset(gdev);
 	dc_reset(gdev);
 
+	/* 初始化副本, 之后不再读取 Display Controller 寄存器 */
+	gxmicro_write(gdev, DC_CTRL(0), 0);
+	gxmicro_write(gdev, DC_CTRL(1), 0);
+	gxmicro_write(gdev, DC_INTERRUPT_ENABLE, 0);
+
+	ret = pci_alloc_irq_vectors(pdev, 1, 1, PCI_IRQ_MSI | PCI_IRQ_LEGACY);
+	if (ret < 0) {
+		pci_err(pdev, "Failed to alloc irq vectors\n");
+		goto err_alloc_irq;
+	}
+
+	ret = request_irq(pci_irq_vector(pdev, 0), gxmicro_irq_handler, IRQF_SHARED, KBUILD_MODNAME, gdev);
+	if (ret) {
+		pci_err(pdev, "Failed to request irq\n");
+		goto err_request_irq;
+	}
+
 	return 0;
 
+err_request_irq:
+	pci_free_irq_vectors(pdev);
+err_alloc_irq:
+	pci_iounmap(pdev, gdev->mmio);
 err_pci_iomap:
 	pci_release_regions(pdev);
 err_request_regions:
@@ -88,6 +178,12 @@ static void gxmicro_pcie_fini(struct pci_dev *pdev)
 {
 	struct gxmicro_dc_dev *gdev = pci_get_drvdata(pdev);
 
+	gxmicro_write(gdev, DC_INTERRUPT_ENABLE, 0);
+
+	free_irq(pci_irq_vector(pdev, 0), gdev);
+
+	pci_free_irq_vectors(pdev);
+
 	pci_iounmap(pdev, gdev->mmio);
 
 	pci_release_regions(pdev);
@@ -109,8 +205,18 @@ static struct drm_driver gxmicro_drm_drv = {
 	.date = GXMICRO_DRM_DATE,
 	.major = GXMICRO_DRM_MAJOR,
 	.minor = GXMICRO_DRM_MINOR,
-	.driver_features = DRIVER_GEM | DRIVER_MODESET,
+	.driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
 	DRM_GEM_VRAM_DRIVER,
+	/* PRIME, 覆盖 DRM_GEM_VRAM_DRIVER 中的 gem_free_object_unlocked */
+	.gem_free_object_unlocked = gxmicro_gem_free_object,
+	.prime_handle_to_fd = drm_gem_prime_handle_to_fd,
+	.prime_fd_to_handle = drm_gem_prime_fd_to_handle,
+	.gem_prime_export = drm_gem_prime_export,
+	.gem_prime_import = gxmicro_gem_prime_import,
+	.gem_prime_pin = gxmicro_gem_prime_pin,
+	.gem_prime_vmap = gxmicro_gem_prime_vmap,
+	.gem_prime_vunmap = gxmicro_gem_prime_vunmap,
+	.gem_prime_mmap = drm_gem_prime_mmap,
 };
 
 static int gxmicro_drm_init(struct pci_dev *pdev)
@@ -149,6 +255,8 @@ static int gxmicro_drm_init(struct pci_dev *pdev)
 	if (ret)
 		goto err_fbdev_setup;
 
+	gxmicro_kms_hpd_enable(gdev);
+
 	return 0;
 
 err_fbdev_setup:
@@ -169,8 +277,13 @@ static void gxmicro_drm_fini(struct pci_dev *pdev)
 	struct gxmicro_dc_dev *gdev = pci_get_drvdata(pdev);
 	struct drm_device *dev = gdev->dev;
 
+	/* 不对已注销的设备发送 hotplug 事件 */
+	gxmicro_kms_hpd_disable(gdev);
+
 	drm_dev_unregister(dev);
 
+	drm_atomic_helper_shutdown(dev);
+
 	gxmicro_kms_fini(gdev);
 
 	gxmicro_ttm_fini(gdev);
@@ -201,8 +314,14 @@ static int gxmicro_dc_probe(struct pci_dev *pdev, const struct pci_device_id *id
 	if (ret)
 		goto err_drm_init;
 
+	ret = gxmicro_jpeg_init(gdev);
+	if (ret)
+		goto err_jpeg_init;
+
 	return 0;
 
+err_jpeg_init:
+	gxmicro_drm_fini(pdev);
 err_drm_init:
 	gxmicro_pcie_fini(pdev);
 	return ret;
@@ -210,6 +329,8 @@ err_drm_init:
 
 static void gxmicro_dc_remove(struct pci_dev *pdev)
 {
+	gxmicro_jpeg_fini(pci_get_drvdata(pdev));
+
 	gxmicro_drm_fini(pdev);
 
 	gxmicro_pcie_fini(pdev);
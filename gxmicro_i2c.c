@@ -18,33 +18,27 @@
 #define GPIOA_SCL	GPIOA_94	/* PROT C GPIO 94 */
 #define GPIOA_SDA	GPIOA_95	/* PROT C GPIO 95 */
 
-static void gxmicro_gpio_set(struct gxmicro_dc_dev *gdev, bool state, uint8_t pin)
-{
-	uint32_t gpio;
-	uint32_t val;
-
-	gpio = gxmicro_read(gdev, GPIOA_PORTC_DDR);
-	gpio |= BIT(pin);
-	gxmicro_write(gdev, GPIOA_PORTC_DDR, gpio);
+/* DDC 速率, sil9134 DDC 最高支持 I2C standard mode */
+#define DDC_MIN_KHZ	10
+#define DDC_MAX_KHZ	100
 
-	val = gxmicro_read(gdev, GPIOA_PORTC_DR);
+static unsigned int ddc_khz = DDC_MAX_KHZ;
+module_param(ddc_khz, uint, 0444);
+MODULE_PARM_DESC(ddc_khz, "DDC bus speed in kHz (10 - 100, default 100)");
 
-	if (state)
-		val |= BIT(pin);
-	else
-		val &= ~BIT(pin);
-
-	gxmicro_write(gdev, GPIOA_PORTC_DR, val);
+/*
+ * 开漏模拟: PORTC_DR 对应位固定输出 0, 只修改 PORTC_DDR
+ * 	输出 0: 设为输出, 拉低
+ * 	输出 1: 设为输入, 由上拉电阻拉高
+ * 寄存器经过副本, 每个边沿最多一次 MMIO 写, 不再读取 DDR / DR
+ */
+static void gxmicro_gpio_set(struct gxmicro_dc_dev *gdev, bool state, uint8_t pin)
+{
+	gxmicro_update_bits(gdev, GPIOA_PORTC_DDR, BIT(pin), state ? 0 : BIT(pin));
 }
 
 static bool gxmicro_gpio_get(struct gxmicro_dc_dev *gdev, uint8_t pin)
 {
-	uint32_t gpio;
-
-	gpio = gxmicro_read(gdev, GPIOA_PORTC_DDR);
-	gpio &= ~BIT(pin);
-	gxmicro_write(gdev, GPIOA_PORTC_DDR, gpio);
-
 	return gxmicro_read(gdev, GPIOA_EXT_PORTC) & BIT(pin);
 }
 
@@ -82,12 +76,16 @@ int gxmicro_i2c_init(struct gxmicro_dc_dev *gdev)
 	i2c_set_adapdata(&gdev->adap, gdev);
 	snprintf(gdev->adap.name, sizeof(gdev->adap.name), I2C_NAME);
 
+	/* SCL / SDA 释放为输入, 输出值固定为 0 */
+	gxmicro_update_bits(gdev, GPIOA_PORTC_DDR, BIT(GPIOA_SCL) | BIT(GPIOA_SDA), 0);
+	gxmicro_update_bits(gdev, GPIOA_PORTC_DR, BIT(GPIOA_SCL) | BIT(GPIOA_SDA), 0);
+
 	algo->data = gdev;
 	algo->setsda = gxmicro_setsda;
 	algo->setscl = gxmicro_setscl;
 	algo->getsda = gxmicro_getsda;
 	algo->getscl = gxmicro_getscl;
-	algo->udelay = 20;
+	algo->udelay = DIV_ROUND_UP(USEC_PER_MSEC / 2, clamp_val(ddc_khz, DDC_MIN_KHZ, DDC_MAX_KHZ));	/* 半个周期 */
 	algo->timeout = usecs_to_jiffies(2200);
 
 	ret = i2c_bit_add_bus(&gdev->adap);
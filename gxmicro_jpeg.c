@@ -0,0 +1,1862 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * GXMicro JPEG Encoder, V4L2 capture
+ *
+ * Copyright (C) 2023 GXMicro (ShangHai) Corp.
+ *
+ * Author:
+ * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
+ */
+#include <linux/hrtimer.h>
+#include <media/v4l2-ctrls.h>
+#include <media/v4l2-dev.h>
+#include <media/v4l2-device.h>
+#include <media/v4l2-event.h>
+#include <media/v4l2-ioctl.h>
+#include <media/videobuf2-v4l2.h>
+#include <media/videobuf2-vmalloc.h>
+#include <drm/drm_fourcc.h>
+
+#include "gxmicro_dc.h"
+
+#define GXMICRO_JPEG_NAME			"gxmicro-jpeg"
+
+/* 私有控件 */
+#define V4L2_CID_GXMICRO_JPEG_BASE		(V4L2_CID_USER_BASE + 0x1f00)
+#define V4L2_CID_GXMICRO_JPEG_QP		(V4L2_CID_GXMICRO_JPEG_BASE + 0)
+#define V4L2_CID_GXMICRO_JPEG_FRAME_SIZE	(V4L2_CID_GXMICRO_JPEG_BASE + 1)
+#define V4L2_CID_GXMICRO_JPEG_KEEPALIVE		(V4L2_CID_GXMICRO_JPEG_BASE + 2)
+#define V4L2_CID_GXMICRO_JPEG_TILES		(V4L2_CID_GXMICRO_JPEG_BASE + 3)
+#define V4L2_CID_GXMICRO_JPEG_READER_RATE	(V4L2_CID_GXMICRO_JPEG_BASE + 4)
+#define V4L2_CID_GXMICRO_JPEG_READER_DROP	(V4L2_CID_GXMICRO_JPEG_BASE + 5)
+
+#define JPEG_KEEPALIVE_MAX_MS			60000
+#define JPEG_KEEPALIVE_DEF_MS			1000
+
+/*
+ * Damage tile
+ * 	无 stride 寄存器, 只能编码整行: JPEG_FB_BASE 偏移到起始行, JPEG_HEIGHT 为行数
+ * 	起始行和行数按 MCU (16 行) 对齐, 行数不小于 JPEG_MIN_HEIGHT
+ * 	在 SOI 之后插入 APP9 "GXTILE", 记录 tile 在屏幕中的位置
+ */
+#define JPEG_TILE_ALIGN				16
+#define JPEG_MARKER_SOI				0xd8
+#define JPEG_MARKER_APP9			0xe9
+#define JPEG_TILE_ID				"GXTILE"
+#define JPEG_SIZEIMAGE				(JPEG_BS_SIZE + sizeof(struct gxmicro_jpeg_tile_app))
+
+/* 大端 */
+struct gxmicro_jpeg_tile_app {
+	uint8_t marker[2];
+	__be16 length;		/* 不包括 marker */
+	char id[sizeof(JPEG_TILE_ID)];
+	__be16 x;
+	__be16 y;
+	__be16 width;
+	__be16 height;
+	__be16 frame_width;
+	__be16 frame_height;
+} __packed;
+
+/* 码率控制 */
+#define JPEG_RC_BITRATE_MIN			100000
+#define JPEG_RC_BITRATE_MAX			1000000000
+#define JPEG_RC_BITRATE_DEF			20000000
+#define JPEG_RC_DEADBAND(target)		((target) / 8)	/* 偏差在 1/8 内不调整 QP */
+
+/*
+ * 多个 read() 用户共享编码结果
+ * 	每帧只编码一次, 复制为引用计数的 frame, 每个 reader 持有最多 JPEG_READER_FRAMES 帧
+ * 	streaming I/O (mmap) 只有一个用户, 与 reader 共享编码器
+ */
+#define JPEG_READER_FRAMES			JPEG_BUFFERS
+#define JPEG_READER_DROP_OLDEST			0
+#define JPEG_READER_DROP_NEWEST			1
+
+#define JPEG_TIMEOUT_NS				(2 * NSEC_PER_SEC / JPEG_RATE)	/* 1080p 编码一帧约 1/JPEG_RATE 秒 */
+
+struct gxmicro_jpeg_buffer {
+	struct vb2_v4l2_buffer vb;
+	struct list_head link;
+};
+
+/* VRAM 中的 bitstream 槽 */
+struct gxmicro_jpeg_slot {
+	uint32_t len;
+	uint32_t sequence;
+	uint64_t timestamp;	/* 开始编码, ns */
+	bool tile;		/* 插入 APP9 "GXTILE" */
+	uint32_t y;		/* 整行编码, x 总为 0 */
+	uint32_t width;
+	uint32_t height;
+	uint32_t frame_height;
+};
+
+struct gxmicro_jpeg_frame {
+	struct kref ref;
+	uint32_t len;
+	uint32_t sequence;
+	uint64_t timestamp;
+	bool tile;		/* tile 模式, 后续的帧依赖此帧 */
+	bool full;		/* 整帧 */
+	uint8_t data[];
+};
+
+/* 每个打开的文件 */
+struct gxmicro_jpeg_fh {
+	struct v4l2_fh fh;
+	struct v4l2_ctrl_handler ctrl_handler;	/* reader 控件和设备控件 */
+
+	struct mutex read_lock;
+	struct gxmicro_jpeg_frame *cur;		/* 正在 read() 的帧 */
+	size_t offset;
+
+	/* jpeg->readers_lock 保护 */
+	bool reader;
+	struct list_head link;
+	struct gxmicro_jpeg_frame *frames[JPEG_READER_FRAMES];
+	uint32_t head;
+	uint32_t count;
+	uint64_t last_ns;
+	uint64_t dropped;
+	bool need_full;		/* tile 模式丢失过帧, 只接收整帧 */
+
+	/* 控件 */
+	uint32_t rate;
+	uint32_t drop;
+};
+
+struct gxmicro_jpeg_stats {
+	uint64_t frames;
+	uint64_t dropped;
+	uint64_t skipped;
+	uint64_t overflows;
+	uint64_t timeouts;
+	uint64_t last_ns;
+	uint64_t max_ns;
+	uint64_t total_ns;
+	uint32_t last_size;
+	uint32_t max_size;
+	uint64_t total_size;
+};
+
+struct gxmicro_jpeg {
+	struct gxmicro_dc_dev *gdev;
+
+	struct v4l2_device v4l2_dev;
+	struct v4l2_ctrl_handler ctrl_handler;
+	struct video_device vdev;
+	struct vb2_queue queue;
+	struct mutex lock;		/* ioctl, vb2 queue */
+
+	void __iomem *bs_vaddr;		/* JPEG bitstream, VRAM 保留区, NULL: 主机内存 */
+	void *bs_cpu[JPEG_BUFFERS];	/* JPEG bitstream, 主机内存 */
+	dma_addr_t bs_dma[JPEG_BUFFERS];
+
+	/* 中断和 hrtimer 中访问 */
+	spinlock_t slock;
+	struct list_head buffers;	/* 已入队, 等待编码 */
+	struct gxmicro_jpeg_slot slots[JPEG_BUFFERS];
+	uint32_t bs_head;		/* 下一个编码的槽 */
+	uint32_t bs_tail;		/* 下一个复制的槽 */
+	uint32_t bs_done;		/* 编码完成, 等待复制的槽数 */
+	bool busy;			/* 正在编码 bs_head */
+	struct gxmicro_scanout_ref *enc_ref;	/* 正在编码的 FrameBuffer */
+	struct gxmicro_scanout_ref *stale_ref;	/* 超时的编码, 可能仍在读取 */
+	bool due;			/* 编码中到达下一帧时间 */
+	uint32_t retry_qp;		/* 溢出后重新编码使用, 0: 控件值 */
+	uint32_t enc_qp;		/* 正在编码使用的 QP */
+	uint32_t rc_qp;			/* 码率控制计算的 QP */
+	bool rc_420;			/* 码率控制切换到 YUV420 */
+	uint32_t sequence;
+	struct gxmicro_jpeg_stats stats;
+
+	/* 跳过未改变的帧 */
+	bool dirty;			/* 需要编码整帧 */
+	struct drm_rect damage;		/* 需要编码的区域 */
+	uint32_t enc_y;			/* 正在编码的行 */
+	uint32_t enc_height;
+	struct gxmicro_scanout last_src;
+	uint64_t last_ns;		/* 上一帧开始编码, ns */
+
+	/* 分辨率和格式改变 */
+	bool mode_changed;		/* modeset 后未编码, 由 gdev->scanout_lock 中设置 */
+	uint32_t src_width;		/* 已通知用户的输入, 0: 未通知 */
+	uint32_t src_height;
+	uint32_t src_format;
+
+	struct hrtimer timer;		/* 帧率 */
+	struct work_struct work;	/* 复制 bitstream 到 vb2 buffer 和 reader */
+	uint32_t consumers;		/* streaming 和 reader 数量, lock 保护 */
+	bool gone;			/* 已移除, 不再访问硬件, lock 保护 */
+
+	struct mutex readers_lock;
+	struct list_head readers;
+	uint32_t nr_readers;
+	wait_queue_head_t wait;
+
+	/* 控件, 下一帧生效 */
+	uint32_t qp;
+	uint32_t subsampling;
+	uint32_t fps;
+	bool rc_enable;
+	uint32_t bitrate;		/* bit/s */
+	uint32_t frame_size;		/* byte/frame, 0: 由 bitrate 计算 */
+	uint32_t keepalive;		/* ms, 0: 不跳过 */
+	bool tiles;
+};
+
+static inline struct gxmicro_jpeg_buffer *to_gxmicro_jpeg_buffer(struct vb2_buffer *vb)
+{
+	return container_of(to_vb2_v4l2_buffer(vb), struct gxmicro_jpeg_buffer, vb);
+}
+
+static inline struct gxmicro_jpeg_fh *to_gxmicro_jpeg_fh(struct file *file)
+{
+	return container_of(file->private_data, struct gxmicro_jpeg_fh, fh);
+}
+
+/* ****************************** Source ****************************** */
+
+/* 只用于查询, 不持有 pin */
+static void gxmicro_jpeg_get_source(struct gxmicro_jpeg *jpeg, struct gxmicro_scanout *src)
+{
+	struct gxmicro_dc_dev *gdev = jpeg->gdev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->scanout_lock, flags);
+	*src = gdev->scanout;
+	spin_unlock_irqrestore(&gdev->scanout_lock, flags);
+}
+
+static bool gxmicro_jpeg_source_valid(const struct gxmicro_scanout *src)
+{
+	switch (src->format) {
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_RGB565:
+		break;
+	default:
+		return false;
+	}
+
+	if (src->width < JPEG_MIN_WIDTH || src->width > JPEG_MAX_WIDTH ||
+			src->height < JPEG_MIN_HEIGHT || src->height > JPEG_MAX_HEIGHT)
+		return false;
+
+	/* 无 stride 寄存器, 源必须连续 */
+	return src->pitch == src->width * src->cpp;
+}
+
+/* ****************************** Bitstream ****************************** */
+
+/*
+ * 编码器按 JPEG_BS_BASE 写入 bitstream
+ * 	默认写入 VRAM 保留区, CPU 通过 BAR 读取, 非 cached 读取很慢
+ * 	jpeg_dma: 写入主机内存, 需要 SoC 将 FB_CUR_BASE 以下的 AXI 地址转发到 PCIe
+ */
+static bool jpeg_dma;
+module_param(jpeg_dma, bool, 0444);
+MODULE_PARM_DESC(jpeg_dma, "JPEG encoder writes bitstreams to host memory by DMA (default false)");
+
+static uint32_t gxmicro_jpeg_bs_base(struct gxmicro_jpeg *jpeg, uint32_t slot)
+{
+	if (!jpeg->bs_vaddr)
+		return jpeg->bs_dma[slot];
+
+	return FB_CUR_OFFSET(jpeg->gdev->jpeg_offset + slot * JPEG_BS_SIZE);
+}
+
+static void gxmicro_jpeg_bs_read(struct gxmicro_jpeg *jpeg, void *dst, uint32_t slot,
+			uint32_t offset, uint32_t len)
+{
+	if (!jpeg->bs_vaddr)
+		memcpy(dst, jpeg->bs_cpu[slot] + offset, len);
+	else
+		memcpy_fromio(dst, jpeg->bs_vaddr + slot * JPEG_BS_SIZE + offset, len);
+}
+
+/*
+ * 失败时使用 VRAM
+ * 	JPEG_BS_BASE 为 AXI 地址, FB_CUR_BASE (2G) 以上为 DDR, 31 位 DMA mask 保证主机内存在 2G 以下
+ */
+static bool gxmicro_jpeg_bs_dma_init(struct gxmicro_jpeg *jpeg)
+{
+	struct pci_dev *pdev = jpeg->gdev->dev->pdev;
+	int i;
+
+	if (dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(31))) {
+		pci_warn(pdev, "Failed to set 31-bit DMA mask for JPEG bitstream\n");
+		return false;
+	}
+
+	pci_set_master(pdev);
+
+	for (i = 0; i < JPEG_BUFFERS; i++) {
+		jpeg->bs_cpu[i] = dmam_alloc_coherent(&pdev->dev, JPEG_BS_SIZE, &jpeg->bs_dma[i], GFP_KERNEL);
+		if (!jpeg->bs_cpu[i]) {
+			pci_warn(pdev, "Failed to alloc JPEG bitstream DMA buffer\n");
+			goto err_alloc;
+		}
+	}
+
+	return true;
+
+err_alloc:
+	while (i--) {
+		dmam_free_coherent(&pdev->dev, JPEG_BS_SIZE, jpeg->bs_cpu[i], jpeg->bs_dma[i]);
+		jpeg->bs_cpu[i] = NULL;
+	}
+	return false;
+}
+
+static int gxmicro_jpeg_bs_init(struct gxmicro_jpeg *jpeg)
+{
+	struct gxmicro_dc_dev *gdev = jpeg->gdev;
+	struct pci_dev *pdev = gdev->dev->pdev;
+
+	if (jpeg_dma && gxmicro_jpeg_bs_dma_init(jpeg)) {
+		pci_info(pdev, "JPEG bitstream in host memory\n");
+		return 0;
+	}
+
+	if (!gdev->jpeg_offset) {
+		pci_warn(pdev, "No VRAM reserved for JPEG bitstream, JPEG encoder disabled\n");
+		return -ENODEV;
+	}
+
+	jpeg->bs_vaddr = pci_iomap_wc_range(pdev, GXMICRO_FB_BAR, gdev->jpeg_offset, JPEG_RESERVED);
+	if (!jpeg->bs_vaddr) {
+		pci_err(pdev, "Failed to map JPEG bitstream\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* 编码器已停止, DMA buffer 由 devres 释放 */
+static void gxmicro_jpeg_bs_fini(struct gxmicro_jpeg *jpeg)
+{
+	if (jpeg->bs_vaddr)
+		pci_iounmap(jpeg->gdev->dev->pdev, jpeg->bs_vaddr);
+}
+
+/* ****************************** Rate Control ****************************** */
+
+static uint32_t gxmicro_jpeg_rc_target(struct gxmicro_jpeg *jpeg)
+{
+	uint32_t frame_size = READ_ONCE(jpeg->frame_size);
+
+	if (frame_size)
+		return frame_size;
+
+	return READ_ONCE(jpeg->bitrate) / BITS_PER_BYTE / READ_ONCE(jpeg->fps);
+}
+
+/*
+ * slock 中调用, 根据上一帧 JPEG_BS_LENGTH 调整下一帧的 QP
+ * 	1. 码流大小近似与 QP 成反比, 每帧最多调整 2 倍, 避免振荡
+ * 	2. QP 达到最大仍超出目标时切换到 YUV420, 码流小于目标一半时恢复
+ */
+static void gxmicro_jpeg_rc_update(struct gxmicro_jpeg *jpeg, uint32_t size)
+{
+	uint32_t target = gxmicro_jpeg_rc_target(jpeg);
+	uint32_t qp = jpeg->enc_qp;
+	uint64_t next;
+
+	if (!READ_ONCE(jpeg->rc_enable) || !target)
+		return;
+
+	if (size > target + JPEG_RC_DEADBAND(target) || size + JPEG_RC_DEADBAND(target) < target) {
+		next = div_u64((uint64_t)qp * size, target);
+		next = clamp_t(uint64_t, next, qp / 2, (uint64_t)qp * 2);
+		jpeg->rc_qp = clamp_t(uint32_t, next, JPEG_QP_MIN, JPEG_QP_MAX);
+	}
+
+	if (!jpeg->rc_420 && jpeg->rc_qp == JPEG_QP_MAX && size > target)
+		jpeg->rc_420 = true;
+	else if (jpeg->rc_420 && size < target / 2)
+		jpeg->rc_420 = false;
+}
+
+/* ****************************** Encode ****************************** */
+
+static void gxmicro_jpeg_stats_update(struct gxmicro_jpeg_stats *stats, uint32_t size, uint64_t ns)
+{
+	stats->frames++;
+
+	stats->last_ns = ns;
+	stats->max_ns = max(stats->max_ns, ns);
+	stats->total_ns += ns;
+
+	stats->last_size = size;
+	stats->max_size = max(stats->max_size, size);
+	stats->total_size += size;
+}
+
+/*
+ * slock 中调用, 上一帧之后扫描是否改变
+ * 	1. FrameBuffer 地址 (page flip, DC_ADDR0/1), 格式或分辨率改变
+ * 	2. primary plane damage (dirtyfb, FB_DAMAGE_CLIPS)
+ * 	3. 超过 keepalive 时间, 用于未使用 dirtyfb 直接写 FrameBuffer 的程序
+ * 硬件光标不在 FrameBuffer 中, 不会被编码, 光标改变不需要编码
+ */
+static bool gxmicro_jpeg_changed(struct gxmicro_jpeg *jpeg, const struct gxmicro_scanout *src)
+{
+	uint32_t keepalive = READ_ONCE(jpeg->keepalive);
+	struct drm_rect damage;
+	struct drm_rect scan;
+
+	/* damage 可能属于上一个模式, 裁剪到当前扫描区域 */
+	drm_rect_init(&scan, 0, 0, src->width, src->height);
+
+	if (gxmicro_kms_damage_take(jpeg->gdev, &damage) && drm_rect_intersect(&damage, &scan)) {
+		if (drm_rect_visible(&jpeg->damage)) {
+			jpeg->damage.y1 = min(jpeg->damage.y1, damage.y1);
+			jpeg->damage.y2 = max(jpeg->damage.y2, damage.y2);
+		} else {
+			jpeg->damage = damage;
+		}
+	}
+
+	if (src->addr != jpeg->last_src.addr || src->format != jpeg->last_src.format ||
+			src->width != jpeg->last_src.width || src->height != jpeg->last_src.height)
+		jpeg->dirty = true;
+
+	/* keepalive 为 0 时不跳过, 没有 damage 时编码整帧, 有 damage 时仍可编码 tile */
+	if (keepalive ? ktime_get_ns() - jpeg->last_ns >= (uint64_t)keepalive * NSEC_PER_MSEC :
+			!drm_rect_visible(&jpeg->damage))
+		jpeg->dirty = true;
+
+	return jpeg->dirty || drm_rect_visible(&jpeg->damage);
+}
+
+/* slock 中调用, 输入改变后的第一帧编码整帧, 通知用户 */
+static void gxmicro_jpeg_reconfig(struct gxmicro_jpeg *jpeg, const struct gxmicro_scanout *src)
+{
+	struct v4l2_event ev = {
+		.type = V4L2_EVENT_SOURCE_CHANGE,
+		.u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION,
+	};
+	bool notify = jpeg->src_width;
+
+	WRITE_ONCE(jpeg->mode_changed, false);
+	jpeg->dirty = true;
+	jpeg->damage.x2 = jpeg->damage.x1;	/* 旧模式的坐标 */
+	jpeg->retry_qp = 0;
+
+	if (src->width == jpeg->src_width && src->height == jpeg->src_height &&
+			src->format == jpeg->src_format)
+		return;
+
+	jpeg->src_width = src->width;
+	jpeg->src_height = src->height;
+	jpeg->src_format = src->format;
+
+	/* bitstream 大小与分辨率无关, buffer 不需要重新分配 */
+	if (notify)
+		v4l2_event_queue(&jpeg->vdev, &ev);
+}
+
+/* damage 所在的整行区域, 满足对齐和最小高度 */
+static void gxmicro_jpeg_tile(const struct gxmicro_scanout *src, const struct drm_rect *damage,
+			uint32_t *y, uint32_t *height)
+{
+	int32_t y1 = ALIGN_DOWN(max(damage->y1, 0), JPEG_TILE_ALIGN);
+	int32_t y2 = min_t(int32_t, ALIGN(damage->y2, JPEG_TILE_ALIGN), src->height);
+
+	if (y2 - y1 < JPEG_MIN_HEIGHT) {
+		y2 = min_t(int32_t, y1 + JPEG_MIN_HEIGHT, src->height);
+		y1 = ALIGN_DOWN(max_t(int32_t, y2 - JPEG_MIN_HEIGHT, 0), JPEG_TILE_ALIGN);
+	}
+
+	*y = y1;
+	*height = y2 - y1;
+}
+
+/* slock 中调用, 溢出的帧未能重新编码, damage 已清除, 下一帧编码整帧 */
+static void gxmicro_jpeg_retry_cancel(struct gxmicro_jpeg *jpeg)
+{
+	if (!jpeg->retry_qp)
+		return;
+
+	jpeg->retry_qp = 0;
+	jpeg->dirty = true;
+}
+
+/* slock 中调用, 编码 bs_head */
+static void gxmicro_jpeg_start(struct gxmicro_jpeg *jpeg)
+{
+	struct gxmicro_dc_dev *gdev = jpeg->gdev;
+	struct gxmicro_jpeg_slot *slot;
+	struct gxmicro_scanout src;
+	uint32_t conf;
+	bool yuv420;
+
+	jpeg->due = false;
+
+	/* 没有空闲的槽, 或没有 buffer 和 reader 接收, 跳过此帧 */
+	if (jpeg->bs_done == JPEG_BUFFERS || (list_empty(&jpeg->buffers) && !READ_ONCE(jpeg->nr_readers)))
+		goto out_retry;
+
+	/* 编码期间持有 FrameBuffer 的 pin, 直接读取扫描的 FrameBuffer */
+	gxmicro_kms_scanout_get(gdev, &src);
+	if (!src.ref || !gxmicro_jpeg_source_valid(&src))
+		goto out_put;
+
+	if (READ_ONCE(jpeg->mode_changed) || src.width != jpeg->src_width ||
+			src.height != jpeg->src_height || src.format != jpeg->src_format)
+		gxmicro_jpeg_reconfig(jpeg, &src);
+
+	/* 溢出重新编码时不检查, 使用相同的区域 */
+	if (!jpeg->retry_qp) {
+		if (!gxmicro_jpeg_changed(jpeg, &src)) {
+			jpeg->stats.skipped++;
+			goto out_put;
+		}
+
+		if (READ_ONCE(jpeg->tiles) && !jpeg->dirty) {
+			gxmicro_jpeg_tile(&src, &jpeg->damage, &jpeg->enc_y, &jpeg->enc_height);
+		} else {
+			jpeg->enc_y = 0;
+			jpeg->enc_height = src.height;
+		}
+
+		/* 编码期间的改变由下一帧编码 */
+		jpeg->dirty = false;
+		jpeg->damage.x2 = jpeg->damage.x1;
+	}
+
+	/* 重新编码前分辨率改变 */
+	if (jpeg->enc_y + jpeg->enc_height > src.height) {
+		jpeg->enc_y = 0;
+		jpeg->enc_height = src.height;
+	}
+
+	jpeg->last_src = src;
+	jpeg->last_ns = ktime_get_ns();
+
+	if (READ_ONCE(jpeg->rc_enable)) {
+		jpeg->enc_qp = jpeg->rc_qp;
+		yuv420 = jpeg->rc_420;
+	} else {
+		jpeg->enc_qp = READ_ONCE(jpeg->qp);
+		yuv420 = false;
+	}
+
+	if (jpeg->retry_qp)
+		jpeg->enc_qp = jpeg->retry_qp;
+
+	yuv420 |= READ_ONCE(jpeg->subsampling) == V4L2_JPEG_CHROMA_SUBSAMPLING_420;
+
+	conf = JPEG_INTR_ENABLE;
+	conf |= yuv420 ? JEPG_BS_YUV420 : JEPG_BS_YUV444;
+	conf |= src.format == DRM_FORMAT_RGB565 ? JPEG_ENC_RBG565 : JPEG_ENC_XRGB8888;
+
+	gxmicro_write(gdev, JPEG_CONF, conf);
+	gxmicro_write(gdev, JPEG_WIDTH, src.width);
+	gxmicro_write(gdev, JPEG_HEIGHT, jpeg->enc_height);
+	gxmicro_write(gdev, JPEG_ENC_QP, jpeg->enc_qp);
+	gxmicro_write(gdev, JPEG_FB_BASE, FB_CUR_OFFSET(src.addr + jpeg->enc_y * src.pitch));
+	gxmicro_write(gdev, JPEG_BS_BASE, gxmicro_jpeg_bs_base(jpeg, jpeg->bs_head));
+	gxmicro_write(gdev, JPEG_BS_LEN_MAX, JPEG_BS_SIZE);
+
+	slot = &jpeg->slots[jpeg->bs_head];
+	slot->timestamp = jpeg->last_ns;
+	slot->tile = READ_ONCE(jpeg->tiles);
+	slot->y = jpeg->enc_y;
+	slot->width = src.width;
+	slot->height = jpeg->enc_height;
+	slot->frame_height = src.height;
+
+	jpeg->enc_ref = src.ref;
+	jpeg->busy = true;
+
+	gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_START);
+
+	return;
+
+out_put:
+	if (src.ref)
+		gxmicro_kms_scanout_put(src.ref);
+out_retry:
+	gxmicro_jpeg_retry_cancel(jpeg);
+}
+
+static void gxmicro_jpeg_put_ref(struct gxmicro_scanout_ref **ref)
+{
+	if (*ref) {
+		gxmicro_kms_scanout_put(*ref);
+		*ref = NULL;
+	}
+}
+
+/* slock 中调用, 编码结束, 之前超时的编码也已结束, 释放 FrameBuffer */
+static void gxmicro_jpeg_release(struct gxmicro_jpeg *jpeg)
+{
+	jpeg->busy = false;
+
+	gxmicro_jpeg_put_ref(&jpeg->enc_ref);
+	gxmicro_jpeg_put_ref(&jpeg->stale_ref);
+}
+
+static void gxmicro_jpeg_halt(struct gxmicro_jpeg *jpeg)
+{
+	struct gxmicro_dc_dev *gdev = jpeg->gdev;
+
+	gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_STOP);
+	gxmicro_write(gdev, JPEG_CONF, 0);
+	gxmicro_write(gdev, JPEG_INTR, JPEG_INTR_CLEAN);
+}
+
+/*
+ * slock 中调用, 没有收到 EOF 中断
+ * 	不确定编码器是否已停止读取, pin 保留到下一帧编码结束
+ */
+static void gxmicro_jpeg_abort(struct gxmicro_jpeg *jpeg)
+{
+	gxmicro_jpeg_halt(jpeg);
+
+	jpeg->busy = false;
+
+	gxmicro_jpeg_put_ref(&jpeg->stale_ref);
+	jpeg->stale_ref = jpeg->enc_ref;
+	jpeg->enc_ref = NULL;
+}
+
+/* slock 中调用, 编码器关闭 (JPEG_CONF 清零), 释放所有 FrameBuffer */
+static void gxmicro_jpeg_stop(struct gxmicro_jpeg *jpeg)
+{
+	gxmicro_jpeg_halt(jpeg);
+	gxmicro_jpeg_release(jpeg);
+	gxmicro_jpeg_retry_cancel(jpeg);
+}
+
+static ktime_t gxmicro_jpeg_interval(struct gxmicro_jpeg *jpeg)
+{
+	return ns_to_ktime(NSEC_PER_SEC / READ_ONCE(jpeg->fps));
+}
+
+static enum hrtimer_restart gxmicro_jpeg_timer(struct hrtimer *timer)
+{
+	struct gxmicro_jpeg *jpeg = container_of(timer, struct gxmicro_jpeg, timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&jpeg->slock, flags);
+
+	if (!jpeg->busy) {
+		gxmicro_jpeg_start(jpeg);
+	} else if (ktime_get_ns() - jpeg->slots[jpeg->bs_head].timestamp > JPEG_TIMEOUT_NS) {
+		/* 没有收到 EOF 中断, 重新开始 */
+		jpeg->stats.timeouts++;
+		jpeg->dirty = true;
+		gxmicro_jpeg_abort(jpeg);
+		gxmicro_jpeg_start(jpeg);
+	} else {
+		/* EOF 中断中开始下一帧 */
+		jpeg->due = true;
+	}
+
+	spin_unlock_irqrestore(&jpeg->slock, flags);
+
+	hrtimer_forward_now(timer, gxmicro_jpeg_interval(jpeg));
+
+	return HRTIMER_RESTART;
+}
+
+irqreturn_t gxmicro_jpeg_irq_handler(struct gxmicro_dc_dev *gdev)
+{
+	struct gxmicro_jpeg *jpeg = READ_ONCE(gdev->jpeg);	/* fini 中 synchronize_irq */
+	struct gxmicro_jpeg_slot *slot;
+	uint32_t intr;
+	uint32_t qp;
+
+	if (!jpeg)
+		return IRQ_NONE;
+
+	intr = gxmicro_read(gdev, JPEG_INTR) & JPEG_INTR_CLEAN;
+	if (!intr)
+		return IRQ_NONE;
+
+	/* 需要重新使能才开始下一帧 */
+	gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_STOP);
+	gxmicro_write(gdev, JPEG_INTR, JPEG_INTR_CLEAN);
+
+	spin_lock(&jpeg->slock);
+
+	if (!jpeg->busy)
+		goto out;
+
+	gxmicro_jpeg_release(jpeg);
+	slot = &jpeg->slots[jpeg->bs_head];
+
+	if (intr & JPEG_BS_OVERFLOW) {
+		jpeg->stats.overflows++;
+
+		/* 以更粗的 QP 重新编码此帧, 码率控制从此 QP 继续 */
+		qp = jpeg->enc_qp;
+		if (qp < JPEG_QP_MAX) {
+			jpeg->retry_qp = min_t(uint32_t, qp * 2, JPEG_QP_MAX);
+			jpeg->rc_qp = jpeg->retry_qp;
+			gxmicro_jpeg_start(jpeg);
+			goto out;
+		}
+
+		if (READ_ONCE(jpeg->rc_enable) && !jpeg->rc_420) {
+			jpeg->retry_qp = qp;
+			jpeg->rc_420 = true;
+			gxmicro_jpeg_start(jpeg);
+			goto out;
+		}
+
+		jpeg->stats.dropped++;
+		jpeg->dirty = true;
+	} else {
+		slot->len = gxmicro_read(gdev, JPEG_BS_LENGTH);
+		slot->sequence = jpeg->sequence++;
+		gxmicro_jpeg_stats_update(&jpeg->stats, slot->len, ktime_get_ns() - slot->timestamp);
+		/* 按整帧大小计算码率 */
+		gxmicro_jpeg_rc_update(jpeg, div_u64((uint64_t)slot->len * slot->frame_height, slot->height));
+
+		jpeg->bs_head = (jpeg->bs_head + 1) % JPEG_BUFFERS;
+		jpeg->bs_done++;
+
+		schedule_work(&jpeg->work);
+	}
+
+	jpeg->retry_qp = 0;
+
+	/* 编码时间超过帧间隔, 立即开始下一帧 */
+	if (jpeg->due)
+		gxmicro_jpeg_start(jpeg);
+
+out:
+	spin_unlock(&jpeg->slock);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * modeset 中调用, 正在编码的帧持有旧的 FrameBuffer, 下一帧重新配置
+ * scanout_lock 与 fini 清除 gdev->jpeg 同步; start 在 slock 中获取 scanout_lock, 这里不能获取 slock
+ */
+void gxmicro_jpeg_mode_set(struct gxmicro_dc_dev *gdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->scanout_lock, flags);
+	if (gdev->jpeg)
+		WRITE_ONCE(gdev->jpeg->mode_changed, true);
+	spin_unlock_irqrestore(&gdev->scanout_lock, flags);
+}
+
+/* 复制 bitstream 到 vaddr, tile 在 SOI 后插入 APP9, 返回长度 */
+static uint32_t gxmicro_jpeg_copy(struct gxmicro_jpeg *jpeg, void *vaddr, uint32_t tail)
+{
+	struct gxmicro_jpeg_slot *slot = &jpeg->slots[tail];
+	struct gxmicro_jpeg_tile_app *app;
+	uint8_t *soi = vaddr;
+
+	if (!slot->tile || slot->len < 2) {
+		gxmicro_jpeg_bs_read(jpeg, vaddr, tail, 0, slot->len);
+		return slot->len;
+	}
+
+	gxmicro_jpeg_bs_read(jpeg, soi, tail, 0, 2);
+	if (soi[0] != 0xff || soi[1] != JPEG_MARKER_SOI) {
+		gxmicro_jpeg_bs_read(jpeg, soi + 2, tail, 2, slot->len - 2);
+		return slot->len;
+	}
+
+	app = vaddr + 2;
+
+	app->marker[0] = 0xff;
+	app->marker[1] = JPEG_MARKER_APP9;
+	app->length = cpu_to_be16(sizeof(*app) - sizeof(app->marker));
+	memcpy(app->id, JPEG_TILE_ID, sizeof(app->id));
+	app->x = 0;
+	app->y = cpu_to_be16(slot->y);
+	app->width = cpu_to_be16(slot->width);
+	app->height = cpu_to_be16(slot->height);
+	app->frame_width = cpu_to_be16(slot->width);
+	app->frame_height = cpu_to_be16(slot->frame_height);
+
+	gxmicro_jpeg_bs_read(jpeg, app + 1, tail, 2, slot->len - 2);
+
+	return slot->len + sizeof(*app);
+}
+
+/* ****************************** Frame ****************************** */
+
+static void gxmicro_jpeg_frame_release(struct kref *kref)
+{
+	kvfree(container_of(kref, struct gxmicro_jpeg_frame, ref));
+}
+
+static void gxmicro_jpeg_frame_put(struct gxmicro_jpeg_frame *frame)
+{
+	kref_put(&frame->ref, gxmicro_jpeg_frame_release);
+}
+
+static struct gxmicro_jpeg_frame *gxmicro_jpeg_frame_create(struct gxmicro_jpeg *jpeg, uint32_t tail)
+{
+	struct gxmicro_jpeg_slot *slot = &jpeg->slots[tail];
+	struct gxmicro_jpeg_frame *frame;
+
+	frame = kvmalloc(struct_size(frame, data, slot->len + sizeof(struct gxmicro_jpeg_tile_app)), GFP_KERNEL);
+	if (!frame)
+		return NULL;
+
+	kref_init(&frame->ref);
+	frame->len = gxmicro_jpeg_copy(jpeg, frame->data, tail);
+	frame->sequence = slot->sequence;
+	frame->timestamp = slot->timestamp;
+	frame->tile = slot->tile;
+	frame->full = slot->y == 0 && slot->height == slot->frame_height;
+
+	return frame;
+}
+
+/* readers_lock 中调用 */
+static void gxmicro_jpeg_reader_flush(struct gxmicro_jpeg_fh *jfh)
+{
+	while (jfh->count) {
+		gxmicro_jpeg_frame_put(jfh->frames[jfh->head]);
+		jfh->head = (jfh->head + 1) % JPEG_READER_FRAMES;
+		jfh->count--;
+	}
+}
+
+/*
+ * tile 模式, tile 只包含改变的行, 依赖之前的每一帧
+ * 	reader 因帧率或队列满丢失任何一帧后, 丢弃 tile 直到下一个整帧
+ * 	到达帧率间隔且队列有空间时请求编码整帧, 返回 true
+ * 	整帧在队列满时取代队列中所有的帧 (DROP_OLDEST)
+ */
+static bool gxmicro_jpeg_fanout_tile(struct gxmicro_jpeg_fh *jfh, struct gxmicro_jpeg_frame *frame,
+			bool due, bool *request)
+{
+	if (!due || (jfh->need_full && !frame->full)) {
+		jfh->need_full = true;
+		*request |= due && jfh->count < JPEG_READER_FRAMES;
+		return false;
+	}
+
+	if (jfh->count == JPEG_READER_FRAMES) {
+		if (!frame->full || READ_ONCE(jfh->drop) == JPEG_READER_DROP_NEWEST) {
+			jfh->dropped++;
+			jfh->need_full = true;
+			return false;
+		}
+
+		jfh->dropped += jfh->count;
+		gxmicro_jpeg_reader_flush(jfh);
+	}
+
+	if (frame->full)
+		jfh->need_full = false;
+
+	return true;
+}
+
+/* 按每个 reader 的帧率和丢帧策略分发 */
+static void gxmicro_jpeg_fanout(struct gxmicro_jpeg *jpeg, struct gxmicro_jpeg_frame *frame)
+{
+	struct gxmicro_jpeg_fh *jfh;
+	bool request = false;
+	bool due;
+
+	mutex_lock(&jpeg->readers_lock);
+
+	list_for_each_entry(jfh, &jpeg->readers, link) {
+		due = !jfh->last_ns || frame->timestamp - jfh->last_ns >= NSEC_PER_SEC / READ_ONCE(jfh->rate);
+
+		if (frame->tile) {
+			if (!gxmicro_jpeg_fanout_tile(jfh, frame, due, &request))
+				continue;
+		} else if (!due) {
+			continue;
+		} else if (jfh->count == JPEG_READER_FRAMES) {
+			jfh->dropped++;
+
+			if (READ_ONCE(jfh->drop) == JPEG_READER_DROP_NEWEST)
+				continue;
+
+			gxmicro_jpeg_frame_put(jfh->frames[jfh->head]);
+			jfh->head = (jfh->head + 1) % JPEG_READER_FRAMES;
+			jfh->count--;
+		}
+
+		kref_get(&frame->ref);
+		jfh->frames[(jfh->head + jfh->count) % JPEG_READER_FRAMES] = frame;
+		jfh->count++;
+		jfh->last_ns = frame->timestamp;
+	}
+
+	mutex_unlock(&jpeg->readers_lock);
+
+	if (request) {
+		spin_lock_irq(&jpeg->slock);
+		jpeg->dirty = true;
+		spin_unlock_irq(&jpeg->slock);
+	}
+
+	wake_up_interruptible(&jpeg->wait);
+}
+
+/* 复制已完成的 bitstream, 不在中断中进行 */
+static void gxmicro_jpeg_work(struct work_struct *work)
+{
+	struct gxmicro_jpeg *jpeg = container_of(work, struct gxmicro_jpeg, work);
+	struct gxmicro_jpeg_frame *frame;
+	struct gxmicro_jpeg_buffer *buf;
+	struct gxmicro_jpeg_slot *slot;
+	uint32_t readers;
+	uint32_t tail;
+	uint32_t len;
+	void *vaddr;
+
+	spin_lock_irq(&jpeg->slock);
+
+	while (jpeg->bs_done) {
+		tail = jpeg->bs_tail;
+		slot = &jpeg->slots[tail];
+		readers = READ_ONCE(jpeg->nr_readers);
+
+		buf = list_first_entry_or_null(&jpeg->buffers, struct gxmicro_jpeg_buffer, link);
+		if (buf)
+			list_del(&buf->link);
+		else if (!readers)
+			jpeg->stats.dropped++;	/* 用户未及时取走 */
+
+		spin_unlock_irq(&jpeg->slock);
+
+		/* 槽在 bs_done 减少前不会被编码器覆盖, 只从 VRAM 读取一次 */
+		frame = readers ? gxmicro_jpeg_frame_create(jpeg, tail) : NULL;
+
+		if (buf) {
+			vaddr = vb2_plane_vaddr(&buf->vb.vb2_buf, 0);
+
+			if (frame) {
+				memcpy(vaddr, frame->data, frame->len);
+				len = frame->len;
+			} else {
+				len = gxmicro_jpeg_copy(jpeg, vaddr, tail);
+			}
+
+			vb2_set_plane_payload(&buf->vb.vb2_buf, 0, len);
+			buf->vb.vb2_buf.timestamp = slot->timestamp;
+			buf->vb.sequence = slot->sequence;
+			buf->vb.field = V4L2_FIELD_NONE;
+			vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+		}
+
+		if (frame) {
+			gxmicro_jpeg_fanout(jpeg, frame);
+			gxmicro_jpeg_frame_put(frame);
+		}
+
+		spin_lock_irq(&jpeg->slock);
+
+		jpeg->bs_tail = (tail + 1) % JPEG_BUFFERS;
+		jpeg->bs_done--;
+	}
+
+	spin_unlock_irq(&jpeg->slock);
+}
+
+/* ****************************** Consumer ****************************** */
+
+/* lock 中调用, 第一个用户启动编码 */
+static void gxmicro_jpeg_consumer_get(struct gxmicro_jpeg *jpeg)
+{
+	if (jpeg->consumers++ || jpeg->gone)
+		return;
+
+	spin_lock_irq(&jpeg->slock);
+
+	jpeg->bs_head = 0;
+	jpeg->bs_tail = 0;
+	jpeg->bs_done = 0;
+	jpeg->due = false;
+	jpeg->retry_qp = 0;
+	jpeg->sequence = 0;
+	memset(&jpeg->stats, 0, sizeof(jpeg->stats));
+	jpeg->dirty = true;	/* 第一帧总是编码 */
+	WRITE_ONCE(jpeg->mode_changed, false);
+	jpeg->src_width = 0;	/* 开始时的输入由 G_FMT 取得 */
+
+	spin_unlock_irq(&jpeg->slock);
+
+	/* 没有用户时 flip 不 pin FrameBuffer */
+	gxmicro_kms_scanout_pin(jpeg->gdev, true);
+
+	hrtimer_start(&jpeg->timer, 0, HRTIMER_MODE_REL);
+}
+
+/* lock 中调用, 最后一个用户停止编码; 已移除时编码器已由 fini 停止 */
+static void gxmicro_jpeg_consumer_put(struct gxmicro_jpeg *jpeg)
+{
+	if (--jpeg->consumers || jpeg->gone)
+		return;
+
+	hrtimer_cancel(&jpeg->timer);
+
+	spin_lock_irq(&jpeg->slock);
+	gxmicro_jpeg_stop(jpeg);
+	spin_unlock_irq(&jpeg->slock);
+
+	gxmicro_kms_scanout_pin(jpeg->gdev, false);
+
+	cancel_work_sync(&jpeg->work);
+}
+
+static int gxmicro_jpeg_reader_add(struct gxmicro_jpeg *jpeg, struct gxmicro_jpeg_fh *jfh)
+{
+	if (mutex_lock_interruptible(&jpeg->lock))
+		return -ERESTARTSYS;
+
+	/* read()/poll() 在 remove 之前进入 */
+	if (jpeg->gone) {
+		mutex_unlock(&jpeg->lock);
+		return -ENODEV;
+	}
+
+	if (!jfh->reader) {
+		mutex_lock(&jpeg->readers_lock);
+		list_add_tail(&jfh->link, &jpeg->readers);
+		jfh->reader = true;
+		jfh->need_full = true;	/* tile 模式从整帧开始 */
+		WRITE_ONCE(jpeg->nr_readers, jpeg->nr_readers + 1);
+		mutex_unlock(&jpeg->readers_lock);
+
+		gxmicro_jpeg_consumer_get(jpeg);
+	}
+
+	mutex_unlock(&jpeg->lock);
+
+	return 0;
+}
+
+/* lock 中调用 */
+static void gxmicro_jpeg_reader_del(struct gxmicro_jpeg *jpeg, struct gxmicro_jpeg_fh *jfh)
+{
+	if (!jfh->reader)
+		return;
+
+	mutex_lock(&jpeg->readers_lock);
+	list_del(&jfh->link);
+	jfh->reader = false;
+	WRITE_ONCE(jpeg->nr_readers, jpeg->nr_readers - 1);
+	gxmicro_jpeg_reader_flush(jfh);
+	mutex_unlock(&jpeg->readers_lock);
+
+	gxmicro_jpeg_consumer_put(jpeg);
+}
+
+/* read_lock 中调用, 取出下一帧 */
+static int gxmicro_jpeg_reader_pop(struct gxmicro_jpeg *jpeg, struct gxmicro_jpeg_fh *jfh, bool nonblock)
+{
+	int ret;
+
+	for (;;) {
+		mutex_lock(&jpeg->readers_lock);
+
+		if (jfh->count) {
+			jfh->cur = jfh->frames[jfh->head];
+			jfh->offset = 0;
+			jfh->head = (jfh->head + 1) % JPEG_READER_FRAMES;
+			jfh->count--;
+			mutex_unlock(&jpeg->readers_lock);
+			return 0;
+		}
+
+		mutex_unlock(&jpeg->readers_lock);
+
+		if (nonblock)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(jpeg->wait,
+				READ_ONCE(jfh->count) || !video_is_registered(&jpeg->vdev));
+		if (ret)
+			return ret;
+
+		if (!video_is_registered(&jpeg->vdev))
+			return -ENODEV;
+	}
+}
+
+/* ****************************** VB2 Queue ****************************** */
+
+static int gxmicro_jpeg_queue_setup(struct vb2_queue *q, unsigned int *num_buffers,
+			unsigned int *num_planes, unsigned int sizes[], struct device *alloc_devs[])
+{
+	if (*num_planes)
+		return sizes[0] < JPEG_SIZEIMAGE ? -EINVAL : 0;
+
+	*num_planes = 1;
+	sizes[0] = JPEG_SIZEIMAGE;
+
+	return 0;
+}
+
+static int gxmicro_jpeg_buf_prepare(struct vb2_buffer *vb)
+{
+	if (vb2_plane_size(vb, 0) < JPEG_SIZEIMAGE)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void gxmicro_jpeg_buf_queue(struct vb2_buffer *vb)
+{
+	struct gxmicro_jpeg *jpeg = vb2_get_drv_priv(vb->vb2_queue);
+	struct gxmicro_jpeg_buffer *buf = to_gxmicro_jpeg_buffer(vb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&jpeg->slock, flags);
+	list_add_tail(&buf->link, &jpeg->buffers);
+	spin_unlock_irqrestore(&jpeg->slock, flags);
+}
+
+static void gxmicro_jpeg_return_buffers(struct gxmicro_jpeg *jpeg, enum vb2_buffer_state state)
+{
+	struct gxmicro_jpeg_buffer *buf, *tmp;
+
+	spin_lock_irq(&jpeg->slock);
+
+	list_for_each_entry_safe(buf, tmp, &jpeg->buffers, link) {
+		list_del(&buf->link);
+		vb2_buffer_done(&buf->vb.vb2_buf, state);
+	}
+
+	spin_unlock_irq(&jpeg->slock);
+}
+
+static int gxmicro_jpeg_start_streaming(struct vb2_queue *q, unsigned int count)
+{
+	struct gxmicro_jpeg *jpeg = vb2_get_drv_priv(q);
+
+	gxmicro_jpeg_consumer_get(jpeg);
+
+	return 0;
+}
+
+static void gxmicro_jpeg_stop_streaming(struct vb2_queue *q)
+{
+	struct gxmicro_jpeg *jpeg = vb2_get_drv_priv(q);
+
+	gxmicro_jpeg_return_buffers(jpeg, VB2_BUF_STATE_ERROR);
+
+	/* reader 仍在使用编码器, 等待正在复制的 buffer 完成 */
+	flush_work(&jpeg->work);
+
+	gxmicro_jpeg_consumer_put(jpeg);
+}
+
+static const struct vb2_ops gxmicro_jpeg_vb2_ops = {
+	.queue_setup = gxmicro_jpeg_queue_setup,
+	.buf_prepare = gxmicro_jpeg_buf_prepare,
+	.buf_queue = gxmicro_jpeg_buf_queue,
+	.start_streaming = gxmicro_jpeg_start_streaming,
+	.stop_streaming = gxmicro_jpeg_stop_streaming,
+	.wait_prepare = vb2_ops_wait_prepare,
+	.wait_finish = vb2_ops_wait_finish,
+};
+
+/* ****************************** V4L2 Ioctl ****************************** */
+
+static int gxmicro_jpeg_querycap(struct file *file, void *fh, struct v4l2_capability *cap)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+
+	strscpy(cap->driver, KBUILD_MODNAME, sizeof(cap->driver));
+	strscpy(cap->card, GXMICRO_JPEG_NAME, sizeof(cap->card));
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "PCI:%s", pci_name(jpeg->gdev->dev->pdev));
+
+	return 0;
+}
+
+static int gxmicro_jpeg_enum_fmt(struct file *file, void *fh, struct v4l2_fmtdesc *f)
+{
+	if (f->index)
+		return -EINVAL;
+
+	f->pixelformat = V4L2_PIX_FMT_JPEG;
+
+	return 0;
+}
+
+static int gxmicro_jpeg_g_fmt(struct file *file, void *fh, struct v4l2_format *f)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+	struct v4l2_pix_format *pix = &f->fmt.pix;
+	struct gxmicro_scanout src;
+
+	/* 分辨率跟随当前扫描, 不可设置 */
+	gxmicro_jpeg_get_source(jpeg, &src);
+
+	memset(pix, 0, sizeof(*pix));
+	pix->width = src.width;
+	pix->height = src.height;
+	pix->pixelformat = V4L2_PIX_FMT_JPEG;
+	pix->field = V4L2_FIELD_NONE;
+	pix->sizeimage = JPEG_SIZEIMAGE;
+	pix->colorspace = V4L2_COLORSPACE_SRGB;
+
+	return 0;
+}
+
+static int gxmicro_jpeg_enum_input(struct file *file, void *fh, struct v4l2_input *inp)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+	struct gxmicro_scanout src;
+
+	if (inp->index)
+		return -EINVAL;
+
+	gxmicro_jpeg_get_source(jpeg, &src);
+
+	strscpy(inp->name, "Display", sizeof(inp->name));
+	inp->type = V4L2_INPUT_TYPE_CAMERA;
+	inp->capabilities = 0;
+	inp->status = gxmicro_jpeg_source_valid(&src) ? 0 : V4L2_IN_ST_NO_SIGNAL;
+
+	return 0;
+}
+
+static int gxmicro_jpeg_g_input(struct file *file, void *fh, unsigned int *i)
+{
+	*i = 0;
+
+	return 0;
+}
+
+static int gxmicro_jpeg_s_input(struct file *file, void *fh, unsigned int i)
+{
+	return i ? -EINVAL : 0;
+}
+
+static int gxmicro_jpeg_g_parm(struct file *file, void *fh, struct v4l2_streamparm *a)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+
+	a->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+	a->parm.capture.readbuffers = JPEG_BUFFERS;
+	a->parm.capture.timeperframe.numerator = 1;
+	a->parm.capture.timeperframe.denominator = jpeg->fps;
+
+	return 0;
+}
+
+static int gxmicro_jpeg_s_parm(struct file *file, void *fh, struct v4l2_streamparm *a)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+	struct v4l2_fract *tpf = &a->parm.capture.timeperframe;
+
+	if (tpf->numerator && tpf->denominator)
+		WRITE_ONCE(jpeg->fps, clamp_val(tpf->denominator / tpf->numerator, 1, JPEG_RATE));
+	else
+		WRITE_ONCE(jpeg->fps, JPEG_RATE);
+
+	return gxmicro_jpeg_g_parm(file, fh, a);
+}
+
+static int gxmicro_jpeg_enum_framesizes(struct file *file, void *fh, struct v4l2_frmsizeenum *fsize)
+{
+	if (fsize->index)
+		return -EINVAL;
+
+	if (fsize->pixel_format != V4L2_PIX_FMT_JPEG)
+		return -EINVAL;
+
+	fsize->type = V4L2_FRMSIZE_TYPE_CONTINUOUS;
+	fsize->stepwise.min_width = JPEG_MIN_WIDTH;
+	fsize->stepwise.max_width = JPEG_MAX_WIDTH;
+	fsize->stepwise.step_width = 1;
+	fsize->stepwise.min_height = JPEG_MIN_HEIGHT;
+	fsize->stepwise.max_height = JPEG_MAX_HEIGHT;
+	fsize->stepwise.step_height = 1;
+
+	return 0;
+}
+
+static int gxmicro_jpeg_enum_frameintervals(struct file *file, void *fh, struct v4l2_frmivalenum *fival)
+{
+	if (fival->index)
+		return -EINVAL;
+
+	if (fival->pixel_format != V4L2_PIX_FMT_JPEG)
+		return -EINVAL;
+
+	fival->type = V4L2_FRMIVAL_TYPE_CONTINUOUS;
+	fival->stepwise.min.numerator = 1;
+	fival->stepwise.min.denominator = JPEG_RATE;
+	fival->stepwise.max.numerator = 1;
+	fival->stepwise.max.denominator = 1;
+	fival->stepwise.step.numerator = 1;
+	fival->stepwise.step.denominator = 1;
+
+	return 0;
+}
+
+static int gxmicro_jpeg_subscribe_event(struct v4l2_fh *fh, const struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case V4L2_EVENT_SOURCE_CHANGE:
+		return v4l2_src_change_event_subscribe(fh, sub);
+	default:
+		return v4l2_ctrl_subscribe_event(fh, sub);
+	}
+}
+
+static int gxmicro_jpeg_log_status(struct file *file, void *fh)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+	struct gxmicro_jpeg_stats stats;
+	uint64_t frames;
+
+	spin_lock_irq(&jpeg->slock);
+	stats = jpeg->stats;
+	spin_unlock_irq(&jpeg->slock);
+
+	frames = max_t(uint64_t, stats.frames, 1);
+
+	v4l2_info(&jpeg->v4l2_dev, "Frames: %llu, dropped: %llu, skipped: %llu, overflows: %llu, timeouts: %llu\n",
+			stats.frames, stats.dropped, stats.skipped, stats.overflows, stats.timeouts);
+	v4l2_info(&jpeg->v4l2_dev, "Encode time: last %lluus, avg %lluus, max %lluus\n",
+			div_u64(stats.last_ns, NSEC_PER_USEC), div64_u64(stats.total_ns, frames * NSEC_PER_USEC),
+			div_u64(stats.max_ns, NSEC_PER_USEC));
+	v4l2_info(&jpeg->v4l2_dev, "Frame size: last %u, avg %llu, max %u\n",
+			stats.last_size, div64_u64(stats.total_size, frames), stats.max_size);
+	v4l2_info(&jpeg->v4l2_dev, "Rate control: %s, target %u, qp %u, %s\n",
+			jpeg->rc_enable ? "on" : "off", gxmicro_jpeg_rc_target(jpeg), jpeg->rc_qp,
+			jpeg->rc_420 ? "yuv420" : "yuv444");
+	v4l2_info(&jpeg->v4l2_dev, "Readers: %u\n", READ_ONCE(jpeg->nr_readers));
+
+	return v4l2_ctrl_log_status(file, fh);
+}
+
+static const struct v4l2_ioctl_ops gxmicro_jpeg_ioctl_ops = {
+	.vidioc_querycap = gxmicro_jpeg_querycap,
+
+	.vidioc_enum_fmt_vid_cap = gxmicro_jpeg_enum_fmt,
+	.vidioc_g_fmt_vid_cap = gxmicro_jpeg_g_fmt,
+	.vidioc_s_fmt_vid_cap = gxmicro_jpeg_g_fmt,
+	.vidioc_try_fmt_vid_cap = gxmicro_jpeg_g_fmt,
+
+	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_querybuf = vb2_ioctl_querybuf,
+	.vidioc_qbuf = vb2_ioctl_qbuf,
+	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
+	.vidioc_streamon = vb2_ioctl_streamon,
+	.vidioc_streamoff = vb2_ioctl_streamoff,
+
+	.vidioc_enum_input = gxmicro_jpeg_enum_input,
+	.vidioc_g_input = gxmicro_jpeg_g_input,
+	.vidioc_s_input = gxmicro_jpeg_s_input,
+
+	.vidioc_g_parm = gxmicro_jpeg_g_parm,
+	.vidioc_s_parm = gxmicro_jpeg_s_parm,
+	.vidioc_enum_framesizes = gxmicro_jpeg_enum_framesizes,
+	.vidioc_enum_frameintervals = gxmicro_jpeg_enum_frameintervals,
+
+	.vidioc_log_status = gxmicro_jpeg_log_status,
+	.vidioc_subscribe_event = gxmicro_jpeg_subscribe_event,
+	.vidioc_unsubscribe_event = v4l2_event_unsubscribe,
+};
+
+/* ****************************** V4L2 Controls ****************************** */
+
+static int gxmicro_jpeg_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct gxmicro_jpeg *jpeg = container_of(ctrl->handler, struct gxmicro_jpeg, ctrl_handler);
+
+	switch (ctrl->id) {
+	case V4L2_CID_GXMICRO_JPEG_QP:
+		WRITE_ONCE(jpeg->qp, ctrl->val);
+		break;
+	case V4L2_CID_JPEG_CHROMA_SUBSAMPLING:
+		WRITE_ONCE(jpeg->subsampling, ctrl->val);
+		break;
+	case V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE:
+		/* 从当前 QP 开始调整 */
+		spin_lock_irq(&jpeg->slock);
+		jpeg->rc_qp = jpeg->qp;
+		jpeg->rc_420 = false;
+		WRITE_ONCE(jpeg->rc_enable, ctrl->val);
+		spin_unlock_irq(&jpeg->slock);
+		break;
+	case V4L2_CID_MPEG_VIDEO_BITRATE:
+		WRITE_ONCE(jpeg->bitrate, ctrl->val);
+		break;
+	case V4L2_CID_GXMICRO_JPEG_FRAME_SIZE:
+		WRITE_ONCE(jpeg->frame_size, ctrl->val);
+		break;
+	case V4L2_CID_GXMICRO_JPEG_KEEPALIVE:
+		WRITE_ONCE(jpeg->keepalive, ctrl->val);
+		break;
+	case V4L2_CID_GXMICRO_JPEG_TILES:
+		WRITE_ONCE(jpeg->tiles, ctrl->val);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static const struct v4l2_ctrl_ops gxmicro_jpeg_ctrl_ops = {
+	.s_ctrl = gxmicro_jpeg_s_ctrl,
+};
+
+/* 值越大压缩率越高, 画质越差 */
+static const struct v4l2_ctrl_config gxmicro_jpeg_ctrl_qp = {
+	.ops = &gxmicro_jpeg_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_JPEG_QP,
+	.name = "JPEG Quantization Parameter",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = JPEG_QP_MIN,
+	.max = JPEG_QP_MAX,
+	.step = 1,
+	.def = JPEG_QP_DEF,
+};
+
+/* 码率控制目标, 非 0 时代替 V4L2_CID_MPEG_VIDEO_BITRATE */
+static const struct v4l2_ctrl_config gxmicro_jpeg_ctrl_frame_size = {
+	.ops = &gxmicro_jpeg_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_JPEG_FRAME_SIZE,
+	.name = "JPEG Target Frame Size",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = JPEG_BS_SIZE,
+	.step = 1,
+	.def = 0,
+};
+
+/* 扫描未改变时的最长编码间隔, 0: 每帧都编码 */
+static const struct v4l2_ctrl_config gxmicro_jpeg_ctrl_keepalive = {
+	.ops = &gxmicro_jpeg_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_JPEG_KEEPALIVE,
+	.name = "JPEG Keep-Alive Interval (ms)",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = JPEG_KEEPALIVE_MAX_MS,
+	.step = 1,
+	.def = JPEG_KEEPALIVE_DEF_MS,
+};
+
+/* 只编码 damage 所在的行, 每帧带 APP9 "GXTILE" */
+static const struct v4l2_ctrl_config gxmicro_jpeg_ctrl_tiles = {
+	.ops = &gxmicro_jpeg_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_JPEG_TILES,
+	.name = "JPEG Damage Tiles",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
+static int gxmicro_jpeg_ctrl_init(struct gxmicro_jpeg *jpeg)
+{
+	struct v4l2_ctrl_handler *hdl = &jpeg->ctrl_handler;
+
+	v4l2_ctrl_handler_init(hdl, 7);
+
+	v4l2_ctrl_new_custom(hdl, &gxmicro_jpeg_ctrl_qp, NULL);
+	v4l2_ctrl_new_std_menu(hdl, &gxmicro_jpeg_ctrl_ops, V4L2_CID_JPEG_CHROMA_SUBSAMPLING,
+			V4L2_JPEG_CHROMA_SUBSAMPLING_420, JPEG_CHROMA_SUBSAMPLING,
+			V4L2_JPEG_CHROMA_SUBSAMPLING_444);
+	v4l2_ctrl_new_std(hdl, &gxmicro_jpeg_ctrl_ops, V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE, 0, 1, 1, 0);
+	v4l2_ctrl_new_std(hdl, &gxmicro_jpeg_ctrl_ops, V4L2_CID_MPEG_VIDEO_BITRATE,
+			JPEG_RC_BITRATE_MIN, JPEG_RC_BITRATE_MAX, 1, JPEG_RC_BITRATE_DEF);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_jpeg_ctrl_frame_size, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_jpeg_ctrl_keepalive, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_jpeg_ctrl_tiles, NULL);
+
+	if (hdl->error) {
+		v4l2_ctrl_handler_free(hdl);
+		return hdl->error;
+	}
+
+	jpeg->v4l2_dev.ctrl_handler = hdl;
+
+	return 0;
+}
+
+/* reader 控件, 每个文件独立 */
+static int gxmicro_jpeg_fh_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct gxmicro_jpeg_fh *jfh = container_of(ctrl->handler, struct gxmicro_jpeg_fh, ctrl_handler);
+
+	switch (ctrl->id) {
+	case V4L2_CID_GXMICRO_JPEG_READER_RATE:
+		WRITE_ONCE(jfh->rate, ctrl->val);
+		break;
+	case V4L2_CID_GXMICRO_JPEG_READER_DROP:
+		WRITE_ONCE(jfh->drop, ctrl->val);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static const struct v4l2_ctrl_ops gxmicro_jpeg_fh_ctrl_ops = {
+	.s_ctrl = gxmicro_jpeg_fh_s_ctrl,
+};
+
+/* read() 每秒最多取得的帧数 */
+static const struct v4l2_ctrl_config gxmicro_jpeg_ctrl_reader_rate = {
+	.ops = &gxmicro_jpeg_fh_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_JPEG_READER_RATE,
+	.name = "JPEG Reader Frame Rate",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 1,
+	.max = JPEG_RATE,
+	.step = 1,
+	.def = JPEG_RATE,
+};
+
+static const char * const gxmicro_jpeg_reader_drop_menu[] = {
+	[JPEG_READER_DROP_OLDEST] = "Drop Oldest",
+	[JPEG_READER_DROP_NEWEST] = "Drop Newest",
+	NULL,
+};
+
+/* reader 未及时 read() 时丢弃的帧 */
+static const struct v4l2_ctrl_config gxmicro_jpeg_ctrl_reader_drop = {
+	.ops = &gxmicro_jpeg_fh_ctrl_ops,
+	.id = V4L2_CID_GXMICRO_JPEG_READER_DROP,
+	.name = "JPEG Reader Drop Policy",
+	.type = V4L2_CTRL_TYPE_MENU,
+	.max = JPEG_READER_DROP_NEWEST,
+	.def = JPEG_READER_DROP_OLDEST,
+	.qmenu = gxmicro_jpeg_reader_drop_menu,
+};
+
+/* ****************************** V4L2 File Operations ****************************** */
+
+static int gxmicro_jpeg_fop_open(struct file *file)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+	struct gxmicro_jpeg_fh *jfh;
+	struct v4l2_ctrl_handler *hdl;
+	int ret;
+
+	jfh = kzalloc(sizeof(struct gxmicro_jpeg_fh), GFP_KERNEL);
+	if (!jfh)
+		return -ENOMEM;
+
+	mutex_init(&jfh->read_lock);
+	jfh->rate = JPEG_RATE;
+	jfh->drop = JPEG_READER_DROP_OLDEST;
+
+	hdl = &jfh->ctrl_handler;
+	v4l2_ctrl_handler_init(hdl, 2);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_jpeg_ctrl_reader_rate, NULL);
+	v4l2_ctrl_new_custom(hdl, &gxmicro_jpeg_ctrl_reader_drop, NULL);
+	v4l2_ctrl_add_handler(hdl, &jpeg->ctrl_handler, NULL, false);
+	if (hdl->error) {
+		ret = hdl->error;
+		goto err_ctrl_init;
+	}
+
+	v4l2_fh_init(&jfh->fh, video_devdata(file));
+	jfh->fh.ctrl_handler = hdl;
+	file->private_data = &jfh->fh;
+	v4l2_fh_add(&jfh->fh);
+
+	return 0;
+
+err_ctrl_init:
+	v4l2_ctrl_handler_free(hdl);
+	kfree(jfh);
+	return ret;
+}
+
+static int gxmicro_jpeg_fop_release(struct file *file)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+	struct gxmicro_jpeg_fh *jfh = to_gxmicro_jpeg_fh(file);
+
+	mutex_lock(&jpeg->lock);
+
+	if (jpeg->queue.owner == &jfh->fh) {
+		vb2_queue_release(&jpeg->queue);
+		jpeg->queue.owner = NULL;
+	}
+
+	gxmicro_jpeg_reader_del(jpeg, jfh);
+
+	mutex_unlock(&jpeg->lock);
+
+	if (jfh->cur)
+		gxmicro_jpeg_frame_put(jfh->cur);
+
+	v4l2_fh_del(&jfh->fh);
+	v4l2_fh_exit(&jfh->fh);
+	v4l2_ctrl_handler_free(&jfh->ctrl_handler);
+	kfree(jfh);
+
+	return 0;
+}
+
+/* read() 为共享的 reader, 每次调用返回一帧的剩余部分 */
+static ssize_t gxmicro_jpeg_fop_read(struct file *file, char __user *data, size_t count, loff_t *ppos)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+	struct gxmicro_jpeg_fh *jfh = to_gxmicro_jpeg_fh(file);
+	ssize_t ret;
+	size_t len;
+
+	if (mutex_lock_interruptible(&jfh->read_lock))
+		return -ERESTARTSYS;
+
+	ret = gxmicro_jpeg_reader_add(jpeg, jfh);
+	if (ret)
+		goto out;
+
+	if (!jfh->cur) {
+		ret = gxmicro_jpeg_reader_pop(jpeg, jfh, file->f_flags & O_NONBLOCK);
+		if (ret)
+			goto out;
+	}
+
+	len = min_t(size_t, count, jfh->cur->len - jfh->offset);
+	if (copy_to_user(data, jfh->cur->data + jfh->offset, len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	jfh->offset += len;
+	if (jfh->offset == jfh->cur->len) {
+		gxmicro_jpeg_frame_put(jfh->cur);
+		jfh->cur = NULL;
+	}
+
+	ret = len;
+
+out:
+	mutex_unlock(&jfh->read_lock);
+	return ret;
+}
+
+static __poll_t gxmicro_jpeg_fop_poll(struct file *file, poll_table *wait)
+{
+	struct gxmicro_jpeg *jpeg = video_drvdata(file);
+	struct gxmicro_jpeg_fh *jfh = to_gxmicro_jpeg_fh(file);
+	__poll_t req_events = poll_requested_events(wait);
+	__poll_t res;
+
+	/* streaming I/O */
+	if (jpeg->queue.owner == &jfh->fh)
+		return vb2_fop_poll(file, wait);
+
+	res = v4l2_ctrl_poll(file, wait);
+
+	if (!(req_events & (EPOLLIN | EPOLLRDNORM)))
+		return res;
+
+	if (gxmicro_jpeg_reader_add(jpeg, jfh))
+		return res | EPOLLERR;
+
+	poll_wait(file, &jpeg->wait, wait);
+
+	if (READ_ONCE(jfh->cur) || READ_ONCE(jfh->count))
+		res |= EPOLLIN | EPOLLRDNORM;
+
+	return res;
+}
+
+static const struct v4l2_file_operations gxmicro_jpeg_fops = {
+	.owner = THIS_MODULE,
+	.open = gxmicro_jpeg_fop_open,
+	.release = gxmicro_jpeg_fop_release,
+	.read = gxmicro_jpeg_fop_read,
+	.poll = gxmicro_jpeg_fop_poll,
+	.mmap = vb2_fop_mmap,
+	.unlocked_ioctl = video_ioctl2,
+};
+
+/* ****************************** JPEG Init & Fini ****************************** */
+
+/* 最后一个文件关闭后调用, 可能晚于 remove; reader 控件引用设备控件 */
+static void gxmicro_jpeg_v4l2_release(struct v4l2_device *v4l2_dev)
+{
+	struct gxmicro_jpeg *jpeg = container_of(v4l2_dev, struct gxmicro_jpeg, v4l2_dev);
+
+	v4l2_ctrl_handler_free(&jpeg->ctrl_handler);
+	kfree(jpeg);
+}
+
+int gxmicro_jpeg_init(struct gxmicro_dc_dev *gdev)
+{
+	struct pci_dev *pdev = gdev->dev->pdev;
+	struct gxmicro_jpeg *jpeg;
+	struct video_device *vdev;
+	struct vb2_queue *q;
+	int ret;
+
+	/* 显存不足, 未保留 bitstream, 只能写入主机内存 */
+	if (!gdev->jpeg_offset && !jpeg_dma)
+		return 0;
+
+	/* 打开的文件可能在 remove 之后关闭, 由 v4l2_dev.release 释放, 不使用 devm */
+	jpeg = kzalloc(sizeof(struct gxmicro_jpeg), GFP_KERNEL);
+	if (!jpeg)
+		return -ENOMEM;
+
+	jpeg->gdev = gdev;
+	jpeg->qp = JPEG_QP_DEF;
+	jpeg->subsampling = V4L2_JPEG_CHROMA_SUBSAMPLING_444;
+	jpeg->fps = JPEG_RATE;
+	jpeg->bitrate = JPEG_RC_BITRATE_DEF;
+	jpeg->rc_qp = JPEG_QP_DEF;
+	jpeg->keepalive = JPEG_KEEPALIVE_DEF_MS;
+	mutex_init(&jpeg->lock);
+	spin_lock_init(&jpeg->slock);
+	INIT_LIST_HEAD(&jpeg->buffers);
+	mutex_init(&jpeg->readers_lock);
+	INIT_LIST_HEAD(&jpeg->readers);
+	init_waitqueue_head(&jpeg->wait);
+	INIT_WORK(&jpeg->work, gxmicro_jpeg_work);
+	hrtimer_init(&jpeg->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	jpeg->timer.function = gxmicro_jpeg_timer;
+
+	ret = gxmicro_jpeg_bs_init(jpeg);
+	if (ret)
+		goto err_bs_init;
+
+	gxmicro_write(gdev, JPEG_CTRL, JPEG_ENC_STOP);
+
+	ret = v4l2_device_register(&pdev->dev, &jpeg->v4l2_dev);
+	if (ret) {
+		pci_err(pdev, "Failed to register v4l2 device\n");
+		goto err_v4l2_register;
+	}
+
+	ret = gxmicro_jpeg_ctrl_init(jpeg);
+	if (ret) {
+		pci_err(pdev, "Failed to init JPEG controls\n");
+		goto err_ctrl_init;
+	}
+
+	q = &jpeg->queue;
+	q->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	/*
+	 * vmalloc 内存, CPU 从 bitstream 复制写入
+	 * bitstream 槽位循环复用且 tile 需插入 APP9, 不能直接导出, 不支持 dma-buf
+	 * read() 不经过 vb2
+	 */
+	q->io_modes = VB2_MMAP;
+	q->drv_priv = jpeg;
+	q->buf_struct_size = sizeof(struct gxmicro_jpeg_buffer);
+	q->ops = &gxmicro_jpeg_vb2_ops;
+	q->mem_ops = &vb2_vmalloc_memops;
+	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	q->min_buffers_needed = JPEG_BUFFERS;
+	q->lock = &jpeg->lock;
+
+	ret = vb2_queue_init(q);
+	if (ret) {
+		pci_err(pdev, "Failed to init vb2 queue\n");
+		goto err_queue_init;
+	}
+
+	vdev = &jpeg->vdev;
+	strscpy(vdev->name, GXMICRO_JPEG_NAME, sizeof(vdev->name));
+	vdev->fops = &gxmicro_jpeg_fops;
+	vdev->ioctl_ops = &gxmicro_jpeg_ioctl_ops;
+	vdev->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_READWRITE | V4L2_CAP_STREAMING;
+	vdev->v4l2_dev = &jpeg->v4l2_dev;
+	vdev->queue = q;
+	vdev->lock = &jpeg->lock;
+	vdev->vfl_dir = VFL_DIR_RX;
+	vdev->release = video_device_release_empty;
+	video_set_drvdata(vdev, jpeg);
+
+	ret = video_register_device(vdev, VFL_TYPE_GRABBER, -1);
+	if (ret) {
+		pci_err(pdev, "Failed to register video device\n");
+		goto err_video_register;
+	}
+
+	/* 注册成功后由最后一个 v4l2_device_put 释放 */
+	jpeg->v4l2_dev.release = gxmicro_jpeg_v4l2_release;
+
+	gdev->jpeg = jpeg;
+
+	pci_info(pdev, "JPEG encoder version 0x%08x, %s\n",
+			gxmicro_read(gdev, JPEG_VERSION), video_device_node_name(vdev));
+
+	return 0;
+
+err_video_register:
+	vb2_queue_release(q);
+err_queue_init:
+	v4l2_ctrl_handler_free(&jpeg->ctrl_handler);
+err_ctrl_init:
+	v4l2_device_unregister(&jpeg->v4l2_dev);
+err_v4l2_register:
+	gxmicro_jpeg_bs_fini(jpeg);
+err_bs_init:
+	kfree(jpeg);
+	/* 没有可用的 bitstream 空间, 不使用编码器 */
+	return ret == -ENODEV ? 0 : ret;
+}
+
+/*
+ * 打开的文件可能比 remove 存在更久, 之后只有 release() 进入驱动
+ * 	停止编码器, 释放 FrameBuffer, 等待中断和 work 结束后不再访问硬件和 gdev
+ * 	jpeg 在最后一个文件关闭后由 gxmicro_jpeg_v4l2_release 释放
+ */
+void gxmicro_jpeg_fini(struct gxmicro_dc_dev *gdev)
+{
+	struct gxmicro_jpeg *jpeg = gdev->jpeg;
+	unsigned long flags;
+
+	if (!jpeg)
+		return;
+
+	video_unregister_device(&jpeg->vdev);
+
+	mutex_lock(&jpeg->lock);
+
+	jpeg->gone = true;
+
+	vb2_queue_release(&jpeg->queue);
+	jpeg->queue.owner = NULL;
+
+	/* reader 可能仍然打开 */
+	hrtimer_cancel(&jpeg->timer);
+
+	spin_lock_irq(&jpeg->slock);
+	gxmicro_jpeg_stop(jpeg);
+	spin_unlock_irq(&jpeg->slock);
+
+	gxmicro_kms_scanout_pin(gdev, false);
+
+	mutex_unlock(&jpeg->lock);
+
+	/* 中断和 modeset 不再访问 jpeg */
+	spin_lock_irqsave(&gdev->scanout_lock, flags);
+	gdev->jpeg = NULL;
+	spin_unlock_irqrestore(&gdev->scanout_lock, flags);
+
+	synchronize_irq(pci_irq_vector(gdev->dev->pdev, 0));
+
+	cancel_work_sync(&jpeg->work);
+
+	/* 唤醒阻塞的 read() */
+	wake_up_interruptible(&jpeg->wait);
+
+	gxmicro_jpeg_bs_fini(jpeg);
+
+	v4l2_device_unregister(&jpeg->v4l2_dev);
+	v4l2_device_put(&jpeg->v4l2_dev);
+}
@@ -8,14 +8,18 @@
  * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
  */
 #include <drm/drm_vram_mm_helper.h>
+#include <drm/drm_atomic.h>
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_color_mgmt.h>
 #include <drm/drm_framebuffer.h>
 #include <drm/drm_fourcc.h>
 #include <drm/drm_gem_framebuffer_helper.h>
 #include <drm/drm_mode.h>
 #include <drm/drm_modeset_helper_vtables.h>
 #include <drm/drm_plane_helper.h>
-#include <drm/drm_crtc_helper.h>
 #include <drm/drm_probe_helper.h>
+#include <drm/drm_vblank.h>
 #include <drm/drm_edid.h>
 
 #include "gxmicro_dc.h"
@@ -27,10 +31,25 @@ static inline void *drm_get_priv(struct drm_device *dev)
 	return dev->dev_private;
 }
 
+/* crtc 和 primary plane 按 pipe 顺序创建 */
+static inline uint32_t gxmicro_crtc_pipe(struct drm_crtc *crtc)
+{
+	return drm_crtc_index(crtc);
+}
+
+static inline uint32_t gxmicro_primary_pipe(struct drm_plane *primary)
+{
+	struct gxmicro_dc_dev *gdev = drm_get_priv(primary->dev);
+
+	return primary - gdev->primary;
+}
+
 /* ****************************** DRM Mode Config ****************************** */
 
 static const struct drm_mode_config_funcs gxmicro_mode_congfig_funcs = {
-	.fb_create = drm_gem_fb_create,
+	.fb_create = drm_gem_fb_create_with_dirty,	/* dirtyfb 转为 FB_DAMAGE_CLIPS */
+	.atomic_check = drm_atomic_helper_check,
+	.atomic_commit = drm_atomic_helper_commit,	/* 支持 DRM_MODE_ATOMIC_NONBLOCK */
 };
 
 static inline void gxmicro_setup_mode_config(struct gxmicro_dc_dev *gdev)
@@ -48,6 +67,295 @@ static inline void gxmicro_setup_mode_config(struct gxmicro_dc_dev *gdev)
 	dev->mode_config.funcs = &gxmicro_mode_congfig_funcs;
 }
 
+/* ****************************** Plane ****************************** */
+
+/*
+ * 导入的 dma-buf 在扫描前复制到 VRAM, plane->state 仍为旧状态
+ * 	fb 改变时 VRAM 副本可能从未复制或已过期, 复制整个 fb
+ * 	fb 未改变时只复制 damage
+ */
+static int gxmicro_plane_import_copy(struct drm_plane_state *old_state, struct drm_plane_state *new_state)
+{
+	struct drm_framebuffer *fb = new_state->fb;
+	struct drm_atomic_helper_damage_iter iter;
+	struct drm_rect clip;
+	int ret;
+
+	if (old_state->fb != fb) {
+		drm_rect_init(&clip, 0, 0, fb->width, fb->height);
+		return gxmicro_gem_prime_copy(fb, &clip);
+	}
+
+	drm_atomic_helper_damage_iter_init(&iter, old_state, new_state);
+	drm_atomic_for_each_plane_damage(&iter, &clip) {
+		ret = gxmicro_gem_prime_copy(new_state->fb, &clip);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* commit 前 pin 到 VRAM, commit 后 unpin 旧 fb */
+static int gxmicro_plane_prepare_fb(struct drm_plane *plane, struct drm_plane_state *new_state)
+{
+	struct drm_device *dev = plane->dev;
+	struct drm_gem_vram_object *gbo;
+	int ret;
+
+	if (!new_state->fb)
+		return 0;
+
+	gbo = drm_gem_vram_of_gem(new_state->fb->obj[0]);
+
+	ret = drm_gem_vram_pin(gbo, DRM_GEM_VRAM_PL_FLAG_VRAM);
+	if (ret) {
+		pci_err(dev->pdev, "Failed to pin %s\n", plane->name);
+		return ret;
+	}
+
+	if (new_state->fb->obj[0]->import_attach) {
+		ret = gxmicro_plane_import_copy(plane->state, new_state);
+		if (ret) {
+			if (ret != -ERESTARTSYS)
+				pci_err(dev->pdev, "Failed to copy imported buffer for %s\n", plane->name);
+			drm_gem_vram_unpin(gbo);
+		}
+	}
+
+	return ret;
+}
+
+static void gxmicro_plane_cleanup_fb(struct drm_plane *plane, struct drm_plane_state *old_state)
+{
+	struct drm_gem_vram_object *gbo;
+
+	if (!old_state->fb)
+		return;
+
+	gbo = drm_gem_vram_of_gem(old_state->fb->obj[0]);
+	drm_gem_vram_unpin(gbo);
+}
+
+static int64_t gxmicro_plane_fb_offset(struct drm_plane_state *state)
+{
+	struct drm_framebuffer *fb = state->fb;
+	struct drm_gem_vram_object *gbo = drm_gem_vram_of_gem(fb->obj[0]);
+	int64_t addr;
+
+	addr = drm_gem_vram_offset(gbo);
+	if (addr < 0)
+		return addr;
+
+	return addr + fb->offsets[0] + (state->src.y1 >> 16) * fb->pitches[0] +
+			(state->src.x1 >> 16) * fb->format->cpp[0];
+}
+
+static const struct drm_plane_funcs gxmicro_plane_funcs = {
+	.update_plane = drm_atomic_helper_update_plane,
+	.disable_plane = drm_atomic_helper_disable_plane,
+	.destroy = drm_plane_cleanup,
+	.reset = drm_atomic_helper_plane_reset,
+	.atomic_duplicate_state = drm_atomic_helper_plane_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_plane_destroy_state,
+};
+
+/* ****************************** Damage ****************************** */
+
+/*
+ * 累计 primary plane 的 damage, 由使用者取走
+ * 	rect 为 framebuffer 坐标, 转换为扫描坐标 (相对 plane src), 扫描区域外的 damage 丢弃
+ */
+static void gxmicro_damage_add(struct gxmicro_dc_dev *gdev, const struct drm_plane_state *state,
+			const struct drm_rect *rect)
+{
+	struct drm_rect *damage = &gdev->damage;
+	struct drm_rect scan;
+	struct drm_rect clip = *rect;
+	unsigned long flags;
+
+	drm_rect_init(&scan, 0, 0, drm_rect_width(&state->src) >> 16, drm_rect_height(&state->src) >> 16);
+	drm_rect_translate(&clip, -(state->src.x1 >> 16), -(state->src.y1 >> 16));
+	if (!drm_rect_intersect(&clip, &scan))
+		return;
+
+	spin_lock_irqsave(&gdev->damage_lock, flags);
+
+	if (drm_rect_visible(damage)) {
+		damage->x1 = min(damage->x1, clip.x1);
+		damage->y1 = min(damage->y1, clip.y1);
+		damage->x2 = max(damage->x2, clip.x2);
+		damage->y2 = max(damage->y2, clip.y2);
+	} else {
+		*damage = clip;
+	}
+
+	spin_unlock_irqrestore(&gdev->damage_lock, flags);
+}
+
+bool gxmicro_kms_damage_take(struct gxmicro_dc_dev *gdev, struct drm_rect *rect)
+{
+	unsigned long flags;
+	bool damaged;
+
+	spin_lock_irqsave(&gdev->damage_lock, flags);
+
+	*rect = gdev->damage;
+	damaged = drm_rect_visible(rect);
+	gdev->damage.x2 = gdev->damage.x1;	/* 清空 */
+
+	spin_unlock_irqrestore(&gdev->damage_lock, flags);
+
+	return damaged;
+}
+
+/* ****************************** Scanout ****************************** */
+
+static unsigned int jpeg_pipe;
+module_param(jpeg_pipe, uint, 0444);
+MODULE_PARM_DESC(jpeg_pipe, "Display pipe captured by the JPEG encoder, 0 or 1 (default 0)");
+
+static void gxmicro_scanout_release_work(struct work_struct *work)
+{
+	struct gxmicro_scanout_ref *ref = container_of(work, struct gxmicro_scanout_ref, work);
+
+	drm_gem_vram_unpin(drm_gem_vram_of_gem(ref->obj));
+	drm_gem_object_put_unlocked(ref->obj);
+
+	kfree(ref);
+}
+
+static void gxmicro_scanout_release(struct kref *kref)
+{
+	struct gxmicro_scanout_ref *ref = container_of(kref, struct gxmicro_scanout_ref, ref);
+
+	schedule_work(&ref->work);
+}
+
+/* 在 FrameBuffer 当前位置再 pin 一次, 旧 fb cleanup_fb 后仍可被 JPEG 读取 */
+static struct gxmicro_scanout_ref *gxmicro_scanout_ref_create(struct drm_framebuffer *fb)
+{
+	struct gxmicro_scanout_ref *ref;
+
+	ref = kzalloc(sizeof(struct gxmicro_scanout_ref), GFP_KERNEL);
+	if (!ref)
+		return NULL;
+
+	if (drm_gem_vram_pin(drm_gem_vram_of_gem(fb->obj[0]), 0)) {
+		kfree(ref);
+		return NULL;
+	}
+
+	kref_init(&ref->ref);
+	ref->obj = fb->obj[0];
+	drm_gem_object_get(ref->obj);
+	INIT_WORK(&ref->work, gxmicro_scanout_release_work);
+
+	return ref;
+}
+
+/* scanout_mutex 中调用, 替换 scanout->ref, ref 为 NULL 且需要 pin 时 (pin 失败) 不允许 JPEG 读取 */
+static void gxmicro_scanout_set(struct gxmicro_dc_dev *gdev, struct drm_framebuffer *fb,
+			const struct gxmicro_scanout *src, struct gxmicro_scanout_ref *ref)
+{
+	struct gxmicro_scanout *scanout = &gdev->scanout;
+	struct gxmicro_scanout_ref *old;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->scanout_lock, flags);
+
+	old = scanout->ref;
+
+	if (fb && (ref || !gdev->scanout_pin)) {
+		*scanout = *src;
+		scanout->ref = ref;
+	} else {
+		memset(scanout, 0, sizeof(*scanout));
+	}
+
+	spin_unlock_irqrestore(&gdev->scanout_lock, flags);
+
+	if (old)
+		gxmicro_kms_scanout_put(old);
+}
+
+/*
+ * 记录 JPEG 编码源, state 为 NULL 时无扫描
+ * 	JPEG 没有用户时只记录地址和格式, 不 pin, 每次 flip 不需要分配和 TTM reserve
+ */
+static void gxmicro_scanout_update(struct gxmicro_dc_dev *gdev, struct drm_plane_state *state, int64_t fb_addr)
+{
+	struct gxmicro_scanout_ref *ref = NULL;
+	struct gxmicro_scanout src = { };
+	struct drm_framebuffer *fb = state ? state->fb : NULL;
+
+	mutex_lock(&gdev->scanout_mutex);
+
+	if (fb) {
+		src.addr = fb_addr;
+		src.format = fb->format->format;
+		src.cpp = fb->format->cpp[0];
+		src.width = drm_rect_width(&state->src) >> 16;
+		src.height = drm_rect_height(&state->src) >> 16;
+		src.pitch = fb->pitches[0];
+
+		if (gdev->scanout_pin)
+			ref = gxmicro_scanout_ref_create(fb);
+	}
+
+	gdev->scanout_fb = fb;
+	gxmicro_scanout_set(gdev, fb, &src, ref);
+
+	mutex_unlock(&gdev->scanout_mutex);
+}
+
+/* JPEG 第一个用户开始和最后一个用户结束时调用, 可睡眠 */
+void gxmicro_kms_scanout_pin(struct gxmicro_dc_dev *gdev, bool pin)
+{
+	struct gxmicro_scanout_ref *ref = NULL;
+	struct gxmicro_scanout src;
+	unsigned long flags;
+
+	mutex_lock(&gdev->scanout_mutex);
+
+	if (gdev->scanout_pin == pin)
+		goto out;
+
+	gdev->scanout_pin = pin;
+
+	spin_lock_irqsave(&gdev->scanout_lock, flags);
+	src = gdev->scanout;
+	spin_unlock_irqrestore(&gdev->scanout_lock, flags);
+
+	/* 正在扫描的 fb 已由 prepare_fb pin, 在下一次 scanout_update 之前有效 */
+	if (pin && gdev->scanout_fb)
+		ref = gxmicro_scanout_ref_create(gdev->scanout_fb);
+
+	gxmicro_scanout_set(gdev, gdev->scanout_fb, &src, ref);
+
+out:
+	mutex_unlock(&gdev->scanout_mutex);
+}
+
+/* 可在中断中调用, 返回的 scanout->ref 由 gxmicro_kms_scanout_put 释放 */
+void gxmicro_kms_scanout_get(struct gxmicro_dc_dev *gdev, struct gxmicro_scanout *scanout)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->scanout_lock, flags);
+
+	*scanout = gdev->scanout;
+	if (scanout->ref)
+		kref_get(&scanout->ref->ref);
+
+	spin_unlock_irqrestore(&gdev->scanout_lock, flags);
+}
+
+void gxmicro_kms_scanout_put(struct gxmicro_scanout_ref *ref)
+{
+	kref_put(&ref->ref, gxmicro_scanout_release);
+}
+
 /* ****************************** Primary Plane ****************************** */
 
 static const uint32_t gxmicro_primary_plane_formats[] = {
@@ -56,156 +364,383 @@ static const uint32_t gxmicro_primary_plane_formats[] = {
 	DRM_FORMAT_RGB565,
 };
 
-#if 0
-static const struct drm_plane_funcs gxmicro_primary_funcs = {
-};
+static int gxmicro_primary_atomic_check(struct drm_plane *primary, struct drm_plane_state *state)
+{
+	struct drm_crtc_state *crtc_state;
+	int ret;
+
+	if (!state->fb || WARN_ON(!state->crtc))
+		return 0;
+
+	crtc_state = drm_atomic_get_new_crtc_state(state->state, state->crtc);
+
+	/* Display Controller 只能从 DC_ADDR0 开始整屏扫描, 不支持缩放和偏移 */
+	ret = drm_atomic_helper_check_plane_state(state, crtc_state,
+				DRM_PLANE_HELPER_NO_SCALING, DRM_PLANE_HELPER_NO_SCALING, false, true);
+	if (ret)
+		return ret;
+
+	/* modeset 或 fb 大小改变时丢弃 damage clips, 按整个 plane 更新 */
+	drm_atomic_helper_check_plane_damage(state->state, state);
+
+	return 0;
+}
+
+static void gxmicro_primary_atomic_update(struct drm_plane *primary, struct drm_plane_state *old_state)
+{
+	struct drm_device *dev = primary->dev;
+	struct gxmicro_dc_dev *gdev = drm_get_priv(dev);
+	struct drm_plane_state *state = primary->state;
+	struct drm_framebuffer *fb = state->fb;
+	const uint32_t format = fb ? fb->format->format : 0;
+	uint32_t pipe = gxmicro_primary_pipe(primary);
+	bool capture = pipe == jpeg_pipe;
+	struct drm_rect damage;
+	uint32_t dctrl;
+	int32_t index;
+	int64_t fb_addr;
+
+	if (!fb || !state->visible) {
+		if (capture)
+			gxmicro_scanout_update(gdev, NULL, 0);
+		return;
+	}
+
+	if (capture && drm_atomic_helper_damage_merged(old_state, state, &damage))
+		gxmicro_damage_add(gdev, state, &damage);
+
+	/* 只有 damage (dirtyfb), 扫描地址未改变, 不需要 flip */
+	if (fb == old_state->fb && drm_rect_equals(&state->src, &old_state->src) &&
+			!drm_atomic_crtc_needs_modeset(state->crtc->state))
+		return;
+
+	fb_addr = gxmicro_plane_fb_offset(state);
+	if (fb_addr < 0) {
+		pci_err(dev->pdev, "Failed to get Framebuffer address\n");
+		return;
+	}
+
+	dctrl = gxmicro_read(gdev, DC_CTRL(pipe)) & ~DC_FB_FORMAT;
+
+	switch (format) {
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XRGB8888:
+		dctrl |= DC_RGB888;
+		break;
+	case DRM_FORMAT_RGB565:
+		dctrl |= DC_RGB565;
+		break;
+	}
+
+	gxmicro_write(gdev, DC_STRIDE(pipe), fb->pitches[0]);
+	gxmicro_write(gdev, DC_ORIGIN(pipe), 0);
+
+	/* 软复位后 DC_FB_INDEX 在第一个 vblank 之前不可靠, 由 vblank 中断重新同步 */
+	if (!old_state->fb || drm_atomic_crtc_needs_modeset(state->crtc->state))
+		WRITE_ONCE(gdev->fb_index[pipe], -1);
+
+	index = READ_ONCE(gdev->fb_index[pipe]);
+	if (index < 0) {
+		/* Modeset: 不确定当前扫描哪个地址寄存器, 两个都写, 不切换 */
+		gxmicro_write(gdev, DC_ADDR0(pipe), fb_addr);
+		gxmicro_write(gdev, DC_ADDR1(pipe), fb_addr);
+
+		gxmicro_write(gdev, DC_CTRL(pipe), dctrl);
+	} else {
+		/* Page flip: 写入未扫描的地址寄存器, 下一帧开始时切换, 避免撕裂 */
+		gxmicro_write(gdev, index ? DC_ADDR0(pipe) : DC_ADDR1(pipe), fb_addr);
+
+		gxmicro_write_trigger(gdev, DC_CTRL(pipe), dctrl, DC_PAGE_FLIP);
+	}
+
+	if (capture)
+		gxmicro_scanout_update(gdev, state, fb_addr);
+
+	pci_dbg(dev->pdev, "Pipe %u Framebuffer format: 0x%08x, stride: 0x%08x, addr: 0x%08llx, dc ctrl: 0x%08x\n",
+			pipe, format, fb->pitches[0], FB_CUR_OFFSET(fb_addr), dctrl);
+}
 
 static const struct drm_plane_helper_funcs gxmicro_primary_helper_funcs = {
+	.prepare_fb = gxmicro_plane_prepare_fb,
+	.cleanup_fb = gxmicro_plane_cleanup_fb,
+	.atomic_check = gxmicro_primary_atomic_check,
+	.atomic_update = gxmicro_primary_atomic_update,
 };
-#endif
 
-static int gxmicro_primary_plane_init(struct gxmicro_dc_dev *gdev)
+static int gxmicro_primary_plane_init(struct gxmicro_dc_dev *gdev, uint32_t pipe)
 {
 	struct drm_device *dev = gdev->dev;
-	struct drm_plane *primary;
+	struct drm_plane *primary = &gdev->primary[pipe];
 	int ret = 0;
 
-	primary = kzalloc(sizeof(struct drm_plane), GFP_KERNEL);	/* kfree() in drm_plane_funcs.destory */
-	if (!primary) {
-		pci_err(dev->pdev, "Failed to allocate Primary Plane\n");
-		return -ENOMEM;
-	}
-
-	ret = drm_universal_plane_init(dev, primary, 0, &drm_primary_helper_funcs,
+	ret = drm_universal_plane_init(dev, primary, BIT(pipe), &gxmicro_plane_funcs,
 				gxmicro_primary_plane_formats, ARRAY_SIZE(gxmicro_primary_plane_formats),
-				NULL, DRM_PLANE_TYPE_PRIMARY, NULL);
+				NULL, DRM_PLANE_TYPE_PRIMARY, "primary-%u", pipe);
 	if (ret < 0) {
-		pci_err(dev->pdev, "Failed to init Primary Plane\n");
-		goto err_plane_init;
+		pci_err(dev->pdev, "Failed to init Primary Plane %u\n", pipe);
+		return ret;
 	}
-#if 0
+
 	drm_plane_helper_add(primary, &gxmicro_primary_helper_funcs);
-#endif
-	gdev->primary = primary;
 
-	return 0;
+	drm_plane_enable_fb_damage_clips(primary);
 
-err_plane_init:
-	kfree(primary);
-	return ret;
+	return 0;
 }
 
 /* ****************************** Cursor Plane ****************************** */
 
-static int gxmicro_cursor_update(struct gxmicro_dc_dev *gdev, struct drm_framebuffer *fb, struct drm_framebuffer *ofb)
+/*
+ * Cursor 图像复制到 VRAM 末尾固定的 CURSOR_SLOTS 个槽中轮流使用,
+ * 切换图像只需写 DC_CURSOR_ADDR, 不需要 pin/unpin 导致 TTM 移动其它 buffer
+ */
+static int gxmicro_cursor_prepare_fb(struct drm_plane *cursor, struct drm_plane_state *new_state)
 {
-	struct drm_device *dev = gdev->dev;
+	struct drm_device *dev = cursor->dev;
 	struct drm_gem_vram_object *gbo;
-	int64_t cur_addr;
 	int ret;
 
-	if (ofb) {
-		gbo = drm_gem_vram_of_gem(ofb->obj[0]);
-		drm_gem_vram_unpin(gbo);
+	if (!new_state->fb)
+		return 0;
+
+	gbo = drm_gem_vram_of_gem(new_state->fb->obj[0]);
+
+	/* 在当前位置 pin, 不移动到 VRAM, 仅保证复制时地址有效 */
+	ret = drm_gem_vram_pin(gbo, 0);
+	if (ret)
+		pci_err(dev->pdev, "Failed to pin %s\n", cursor->name);
+
+	return ret;
+}
+
+/* 将 Cursor 寄存器写入硬件, cursor_lock 保护; 经过副本, 只写改变的寄存器 */
+static void gxmicro_cursor_write(struct gxmicro_dc_dev *gdev)
+{
+	gxmicro_write(gdev, DC_CURSOR_ADDR, gdev->cursor_offset + gdev->cursor_slot * CURSOR_SIZE);
+	gdev->cursor_scan = gdev->cursor_slot;
+	gxmicro_write(gdev, DC_CURSOR_LOCATION, gdev->cursor_loc);
+	gxmicro_write(gdev, DC_CURSOR_CTRL, gdev->cursor_ctrl);
+}
+
+/*
+ * Cursor 寄存器在下一个 vblank 中断中写入, 同一帧内多次更新只写最后一次
+ * Crtc 关闭 (无 vblank) 时直接写入
+ */
+static void gxmicro_cursor_queue(struct gxmicro_dc_dev *gdev, int32_t slot, uint32_t ctrl, uint32_t loc)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->cursor_lock, flags);
+
+	if (slot >= 0)
+		gdev->cursor_slot = slot;
+	gdev->cursor_ctrl = ctrl;
+	gdev->cursor_loc = loc;
+
+	if (!gdev->cursor_pending) {
+		if (drm_crtc_vblank_get(&gdev->crtc[0]) == 0)
+			gdev->cursor_pending = true;
+		else
+			gxmicro_cursor_write(gdev);
 	}
 
-	gbo = drm_gem_vram_of_gem(fb->obj[0]);
+	spin_unlock_irqrestore(&gdev->cursor_lock, flags);
+}
 
-	ret = drm_gem_vram_pin(gbo, DRM_GEM_VRAM_PL_FLAG_VRAM);
-	if (ret) {
-		pci_err(dev->pdev, "Failed to pin Cursor Plane\n");
-		return ret;
+static void gxmicro_cursor_vblank(struct gxmicro_dc_dev *gdev)
+{
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&gdev->cursor_lock, flags);
+
+	pending = gdev->cursor_pending;
+	if (pending) {
+		gxmicro_cursor_write(gdev);
+		gdev->cursor_pending = false;
+	}
+
+	spin_unlock_irqrestore(&gdev->cursor_lock, flags);
+
+	if (pending)
+		drm_crtc_vblank_put(&gdev->crtc[0]);
+}
+
+/*
+ * 从 cursor_copy 之后选择下一个槽, 跳过 DC_CURSOR_ADDR 正在扫描的槽,
+ * 以及等待 vblank 写入的槽 (复制期间可能被中断写入 DC_CURSOR_ADDR);
+ * 最多占用 2 个槽, CURSOR_SLOTS 个槽中总有空闲
+ */
+static uint32_t gxmicro_cursor_next_slot(struct gxmicro_dc_dev *gdev)
+{
+	unsigned long flags;
+	uint32_t busy;
+	uint32_t slot;
+
+	spin_lock_irqsave(&gdev->cursor_lock, flags);
+	busy = BIT(gdev->cursor_scan);
+	if (gdev->cursor_pending)
+		busy |= BIT(gdev->cursor_slot);
+	spin_unlock_irqrestore(&gdev->cursor_lock, flags);
+
+	slot = (gdev->cursor_copy + 1) % CURSOR_SLOTS;
+	while (busy & BIT(slot))
+		slot = (slot + 1) % CURSOR_SLOTS;
+
+	return slot;
+}
+
+/* 复制 Cursor 图像到下一个槽, 返回槽号, 在 vblank 时切换 DC_CURSOR_ADDR */
+static int32_t gxmicro_cursor_update(struct gxmicro_dc_dev *gdev, struct drm_plane_state *state)
+{
+	struct drm_device *dev = gdev->dev;
+	struct drm_framebuffer *fb = state->fb;
+	struct drm_gem_vram_object *gbo = drm_gem_vram_of_gem(fb->obj[0]);
+	uint32_t row[CURSOR_WIDTH];
+	void __iomem *dst;
+	uint8_t *src;
+	bool is_iomem;
+	uint32_t slot;
+	int i;
+
+	src = drm_gem_vram_kmap(gbo, true, &is_iomem);
+	if (IS_ERR(src)) {
+		pci_err(dev->pdev, "Failed to map Cursor\n");
+		return -1;
 	}
 
-	cur_addr = drm_gem_vram_offset(gbo);
-	if (cur_addr < 0) {
-		ret = (int)cur_addr;
-		pci_err(dev->pdev, "Failed to get Cursor address\n");
-		goto err_cursor_offset;
+	slot = gxmicro_cursor_next_slot(gdev);
+	dst = gdev->cursor_vaddr + slot * CURSOR_SIZE;
+	src += fb->offsets[0];
+
+	for (i = 0; i < CURSOR_HEIGHT; i++, src += fb->pitches[0], dst += sizeof(row)) {
+		if (is_iomem) {
+			memcpy_fromio(row, (void __iomem *)src, sizeof(row));
+			memcpy_toio(dst, row, sizeof(row));
+		} else {
+			memcpy_toio(dst, src, sizeof(row));
+		}
 	}
 
-	gxmicro_write(gdev, DC_CURSOR_ADDR, cur_addr);
+	drm_gem_vram_kunmap(gbo);
 
-	pci_dbg(dev->pdev, "Cursor width * height: 0x%08x * 0x%08x, stride: 0x%08x, Cursor fb addr: 0x%08llx\n",
-				fb->width, fb->height, fb->pitches[0], FB_CUR_OFFSET(cur_addr));
+	gdev->cursor_copy = slot;
 
-	return 0;
+	pci_dbg(dev->pdev, "Cursor width * height: 0x%08x * 0x%08x, stride: 0x%08x, Cursor slot %u addr: 0x%08llx\n",
+				fb->width, fb->height, fb->pitches[0], slot,
+				FB_CUR_OFFSET((uint64_t)gdev->cursor_offset + slot * CURSOR_SIZE));
 
-err_cursor_offset:
-	drm_gem_vram_unpin(gbo);
-	return ret;
+	return slot;
 }
 
-static void gxmicro_cursor_move(struct gxmicro_dc_dev *gdev,
-			int32_t hotx, int32_t hoty, int32_t x, int32_t y)
+static void gxmicro_cursor_commit(struct gxmicro_dc_dev *gdev, struct drm_plane_state *state,
+				struct drm_framebuffer *old_fb)
 {
 	struct drm_device *dev = gdev->dev;
+	struct drm_framebuffer *fb = state->fb;
+	int32_t slot = -1;
 	uint32_t cur_ctrl;
 	uint32_t cur_loc;
 
-	cur_ctrl = CURSOR_HOTSPOT(hotx, hoty);
-	cur_loc = CURSOR_LOCATOIN(x, hotx, y, hoty);
+	if (!fb || !state->visible) {
+		gxmicro_cursor_queue(gdev, -1, CUR_DISABLE, gdev->cursor_loc);
+		return;
+	}
+
+	if (fb != old_fb)
+		slot = gxmicro_cursor_update(gdev, state);
 
-	gxmicro_write(gdev, DC_CURSOR_LOCATION, cur_loc);
+	cur_ctrl = CURSOR_HOTSPOT(fb->hot_x, fb->hot_y);
+	cur_loc = CURSOR_LOCATOIN(state->crtc_x, fb->hot_x, state->crtc_y, fb->hot_y);
 
-	gxmicro_write(gdev, DC_CURSOR_CTRL, cur_ctrl);
+	gxmicro_cursor_queue(gdev, slot, cur_ctrl, cur_loc);
 
 	pci_dbg(dev->pdev, "Cursor ctrl: 0x%08x, loction: 0x%08x, "
 			"hotx: 0x%08x, hoty: 0x%08x, x: 0x%08x, y: 0x%08x\n",
-			cur_ctrl, cur_loc, hotx, hoty, x, y);
+			cur_ctrl, cur_loc, fb->hot_x, fb->hot_y, state->crtc_x, state->crtc_y);
 }
 
-static int gxmicro_cursor_update_plane(struct drm_plane *cursor, struct drm_crtc *crtc, struct drm_framebuffer *fb,
-				int crtc_x, int crtc_y, unsigned int crtc_w, unsigned int crtc_h,
-				uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h,
-				struct drm_modeset_acquire_ctx *ctx)
+static int gxmicro_cursor_atomic_check(struct drm_plane *cursor, struct drm_plane_state *state)
 {
-	struct gxmicro_dc_dev *gdev = drm_get_priv(cursor->dev);
-	int ret = 0;
+	struct drm_framebuffer *fb = state->fb;
+	struct drm_crtc_state *crtc_state;
 
-	if (fb != cursor->fb) {
-		ret = gxmicro_cursor_update(gdev, fb, cursor->fb);
-		if (ret)
-			return ret;
-	}
+	if (!fb || WARN_ON(!state->crtc))
+		return 0;
 
-	gxmicro_cursor_move(gdev, fb->hot_x, fb->hot_y, crtc_x, crtc_y);
+	/* Cursor 固定为 CURSOR_WIDTH * CURSOR_HEIGHT ARGB8888 */
+	if (fb->width != CURSOR_WIDTH || fb->height != CURSOR_HEIGHT)
+		return -EINVAL;
 
-	return 0;
+	crtc_state = drm_atomic_get_new_crtc_state(state->state, state->crtc);
+
+	return drm_atomic_helper_check_plane_state(state, crtc_state,
+				DRM_PLANE_HELPER_NO_SCALING, DRM_PLANE_HELPER_NO_SCALING, true, true);
+}
+
+static void gxmicro_cursor_atomic_update(struct drm_plane *cursor, struct drm_plane_state *old_state)
+{
+	struct gxmicro_dc_dev *gdev = drm_get_priv(cursor->dev);
+
+	gxmicro_cursor_commit(gdev, cursor->state, old_state->fb);
 }
 
-static int gxmicro_cursor_disable_plane(struct drm_plane *cursor, struct drm_modeset_acquire_ctx *ctx)
+static void gxmicro_cursor_atomic_disable(struct drm_plane *cursor, struct drm_plane_state *old_state)
 {
 	struct drm_device *dev = cursor->dev;
 	struct gxmicro_dc_dev *gdev = drm_get_priv(dev);
-	struct drm_gem_vram_object *gbo;
 
-	gxmicro_write(gdev, DC_CURSOR_CTRL, CUR_DISABLE);
-
-	if (cursor->fb) {
-		gbo = drm_gem_vram_of_gem(cursor->fb->obj[0]);
-		drm_gem_vram_unpin(gbo);
-	}
+	gxmicro_cursor_queue(gdev, -1, CUR_DISABLE, gdev->cursor_loc);
 
 	pci_dbg(dev->pdev, "Disable Cursor\n");
+}
+
+/* legacy cursor ioctl (移动/切换图像) 不经过完整 commit 流程, 不等待 vblank */
+static int gxmicro_cursor_atomic_async_check(struct drm_plane *cursor, struct drm_plane_state *state)
+{
+	if (!state->crtc->state->active)
+		return -EINVAL;
 
 	return 0;
 }
 
+static void gxmicro_cursor_atomic_async_update(struct drm_plane *cursor, struct drm_plane_state *new_state)
+{
+	struct gxmicro_dc_dev *gdev = drm_get_priv(cursor->dev);
+	struct drm_plane_state *state = cursor->state;
+	struct drm_framebuffer *old_fb = state->fb;
+
+	/* 旧 fb 放入 new_state, 由 cleanup_fb 释放 */
+	swap(state->fb, new_state->fb);
+
+	state->crtc_x = new_state->crtc_x;
+	state->crtc_y = new_state->crtc_y;
+	state->crtc_w = new_state->crtc_w;
+	state->crtc_h = new_state->crtc_h;
+	state->src_x = new_state->src_x;
+	state->src_y = new_state->src_y;
+	state->src_w = new_state->src_w;
+	state->src_h = new_state->src_h;
+	state->src = new_state->src;
+	state->dst = new_state->dst;
+	state->visible = new_state->visible;
+
+	gxmicro_cursor_commit(gdev, state, old_fb);
+}
+
 static const uint32_t gxmicro_cursor_plane_formats[] = {
 	DRM_FORMAT_ARGB8888,
 };
 
-static const struct drm_plane_funcs gxmicro_cursor_funcs = {
-	.destroy = drm_plane_cleanup,
-	.update_plane = gxmicro_cursor_update_plane,
-	.disable_plane = gxmicro_cursor_disable_plane,
-};
-
-#if 0
 static const struct drm_plane_helper_funcs gxmicro_cursor_helper_funcs = {
+	.prepare_fb = gxmicro_cursor_prepare_fb,
+	.cleanup_fb = gxmicro_plane_cleanup_fb,
+	.atomic_check = gxmicro_cursor_atomic_check,
+	.atomic_update = gxmicro_cursor_atomic_update,
+	.atomic_disable = gxmicro_cursor_atomic_disable,
+	.atomic_async_check = gxmicro_cursor_atomic_async_check,
+	.atomic_async_update = gxmicro_cursor_atomic_async_update,
 };
-#endif
 
 static int gxmicro_cursor_plane_init(struct gxmicro_dc_dev *gdev)
 {
@@ -213,122 +748,146 @@ static int gxmicro_cursor_plane_init(struct gxmicro_dc_dev *gdev)
 	struct drm_plane *cursor = &gdev->cursor;
 	int ret = 0;
 
-	ret = drm_universal_plane_init(dev, cursor, 0, &gxmicro_cursor_funcs,
+	/* CURSOR_DISPLAY 固定在 FB 0 */
+	ret = drm_universal_plane_init(dev, cursor, BIT(0), &gxmicro_plane_funcs,
 				gxmicro_cursor_plane_formats, ARRAY_SIZE(gxmicro_cursor_plane_formats),
 				NULL, DRM_PLANE_TYPE_CURSOR, NULL);
 	if (ret < 0) {
 		pci_err(dev->pdev, "Failed to init Cursor Plane\n");
 		return ret;
 	}
-#if 0
+
 	drm_plane_helper_add(cursor, &gxmicro_cursor_helper_funcs);
-#endif
+
 	return 0;
 }
 
-/* ****************************** Crtc ****************************** */
+/* ****************************** Gamma ****************************** */
 
-static void gxmicro_crtc_dpms(struct drm_crtc *crtc, int mode)
+/* gamma_lock 中调用, 只写入与副本不同的连续区间 */
+static void gxmicro_gamma_write(struct gxmicro_dc_dev *gdev, uint32_t pipe)
 {
-	struct drm_device *dev = crtc->dev;
-	struct gxmicro_dc_dev *gdev = drm_get_priv(dev);
+	struct gxmicro_gamma *gamma = &gdev->gamma[pipe];
+	uint32_t i = 0;
 
-	switch (mode) {
-	case DRM_MODE_DPMS_ON:
-		/* fallthrough */
-	case DRM_MODE_DPMS_STANDBY:
-		/* fallthrough */
-	case DRM_MODE_DPMS_SUSPEND:
-		gdev->dctrl |= DC_ENABLE;
-		break;
-	case DRM_MODE_DPMS_OFF:
-		gdev->dctrl &= ~DC_ENABLE;
-		break;
-	}
+	while (i < GAMMA_SIZE) {
+		if (gamma->hw_valid && gamma->hw[i] == gamma->next[i]) {
+			i++;
+			continue;
+		}
 
-	gxmicro_write(gdev, DC_CTRL, gdev->dctrl);
+		gxmicro_write(gdev, DC_GAMMA_INDEX(pipe), i);
 
-	pci_dbg(dev->pdev, "%s Display Controller, dc ctrl: 0x%08x\n",
-			mode == 3 ? "Disabled" : "Enabled", gdev->dctrl);
-}
+		for (; i < GAMMA_SIZE && (!gamma->hw_valid || gamma->hw[i] != gamma->next[i]); i++) {
+			gxmicro_write(gdev, DC_GAMMA_DATA(pipe), gamma->next[i]);
+			gamma->hw[i] = gamma->next[i];
+		}
+	}
 
-static void gxmicro_crtc_prepare(struct drm_crtc *crtc)
-{
-	gxmicro_crtc_dpms(crtc, DRM_MODE_DPMS_OFF);
+	gamma->hw_valid = true;
 }
 
-static void gxmicro_crtc_commit(struct drm_crtc *crtc)
+/* 软复位后硬件中的 Gamma 表未知, 下次全部写入 */
+static void gxmicro_gamma_invalidate(struct gxmicro_dc_dev *gdev, uint32_t pipe)
 {
-	gxmicro_crtc_dpms(crtc, DRM_MODE_DPMS_ON);
+	unsigned long flags;
+
+	spin_lock_irqsave(&gdev->gamma_lock, flags);
+	gdev->gamma[pipe].hw_valid = false;
+	spin_unlock_irqrestore(&gdev->gamma_lock, flags);
 }
 
-static int gxmicro_crtc_mode_set_base(struct drm_crtc *crtc, int x, int y, struct drm_framebuffer *ofb)
+/* vblank 中断中写入等待的 Gamma 表 */
+static void gxmicro_gamma_vblank(struct gxmicro_dc_dev *gdev, uint32_t pipe)
 {
-	struct drm_device *dev = crtc->dev;
-	struct gxmicro_dc_dev *gdev = drm_get_priv(dev);
-	struct drm_framebuffer *fb = crtc->primary->fb;
-	struct drm_gem_vram_object *gbo;
-	int ret;
-	int64_t fb_addr;
+	struct gxmicro_gamma *gamma = &gdev->gamma[pipe];
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&gdev->gamma_lock, flags);
 
-	if (ofb) {
-		gbo = drm_gem_vram_of_gem(ofb->obj[0]);
-		drm_gem_vram_unpin(gbo);
+	pending = gamma->pending;
+	if (pending) {
+		gxmicro_gamma_write(gdev, pipe);
+		gamma->pending = false;
 	}
 
-	gbo = drm_gem_vram_of_gem(fb->obj[0]);
+	spin_unlock_irqrestore(&gdev->gamma_lock, flags);
 
-	ret = drm_gem_vram_pin(gbo, DRM_GEM_VRAM_PL_FLAG_VRAM);
-	if (ret) {
-		pci_err(dev->pdev, "Failed to pin Primary Plane\n");
-		return ret;
-	}
+	if (pending)
+		drm_crtc_vblank_put(&gdev->crtc[pipe]);
+}
 
-	fb_addr = drm_gem_vram_offset(gbo);
-	if (fb_addr < 0) {
-		ret = (int)fb_addr;
-		pci_err(dev->pdev, "Failed to get Framebuffer address\n");
-		goto err_crtc_vram_offset;
+/*
+ * atomic_flush 中调用, GAMMA_LUT 改变或 modeset (软复位后 Gamma 表未知) 时
+ * 	1. 已使能: 在下一个 vblank 写入改变的项, 不等待
+ * 	2. 未使能或 modeset (crtc 尚未使能): 直接写入后使能, 避免使能后一帧使用旧表
+ * GAMMA_ENABLE 经过副本, 只在改变时写入
+ */
+static void gxmicro_gamma_commit(struct gxmicro_dc_dev *gdev, struct drm_crtc *crtc)
+{
+	struct drm_crtc_state *state = crtc->state;
+	uint32_t pipe = gxmicro_crtc_pipe(crtc);
+	struct gxmicro_gamma *gamma = &gdev->gamma[pipe];
+	bool modeset = drm_atomic_crtc_needs_modeset(state);
+	struct drm_color_lut *lut;
+	unsigned long flags;
+	bool enabled;
+	bool put;
+	int i;
+
+	if (!state->color_mgmt_changed && !modeset)
+		return;
+
+	if (!state->gamma_lut) {
+		gxmicro_update_bits(gdev, DC_CTRL(pipe), GAMMA_ENABLE, 0);
+
+		spin_lock_irqsave(&gdev->gamma_lock, flags);
+		put = gamma->pending;
+		gamma->pending = false;
+		spin_unlock_irqrestore(&gdev->gamma_lock, flags);
+
+		if (put)
+			drm_crtc_vblank_put(crtc);
+		return;
 	}
 
-	gxmicro_write(gdev, DC_ADDR0, fb_addr);
+	lut = state->gamma_lut->data;
+	enabled = !modeset && (gxmicro_read(gdev, DC_CTRL(pipe)) & GAMMA_ENABLE);
 
-	pci_dbg(dev->pdev, "Framebuffer addr: 0x%08llx\n", FB_CUR_OFFSET(fb_addr));
+	spin_lock_irqsave(&gdev->gamma_lock, flags);
 
-	return 0;
+	for (i = 0; i < GAMMA_SIZE; i++)
+		gamma->next[i] = GAMMA_DATA(lut[i].red, lut[i].green, lut[i].blue);
 
-err_crtc_vram_offset:
-	drm_gem_vram_unpin(gbo);
-	return ret;
+	/* 已等待 vblank 时只更新 next */
+	if (!enabled) {
+		gxmicro_gamma_write(gdev, pipe);
+	} else if (!gamma->pending) {
+		if (drm_crtc_vblank_get(crtc) == 0)
+			gamma->pending = true;
+		else
+			gxmicro_gamma_write(gdev, pipe);
+	}
+
+	spin_unlock_irqrestore(&gdev->gamma_lock, flags);
+
+	gxmicro_update_bits(gdev, DC_CTRL(pipe), GAMMA_ENABLE, GAMMA_ENABLE);
 }
 
-static int gxmicro_crtc_mode_set(struct drm_crtc *crtc, struct drm_display_mode *mode,
-			struct drm_display_mode *adjusted_mode, int x, int y, struct drm_framebuffer *ofb)
+/* ****************************** Crtc ****************************** */
+
+static void gxmicro_crtc_mode_set_nofb(struct drm_crtc *crtc)
 {
 	struct drm_device *dev = crtc->dev;
 	struct gxmicro_dc_dev *gdev = drm_get_priv(dev);
-	const struct drm_framebuffer *fb = crtc->primary->fb;
-	const uint32_t format = fb->format->format;
+	struct drm_display_mode *mode = &crtc->state->adjusted_mode;
+	uint32_t pipe = gxmicro_crtc_pipe(crtc);
 	uint32_t hdisplay = 0;
 	uint32_t hsync = 0;
 	uint32_t vdisplay = 0;
 	uint32_t vsync = 0;
 
-	gdev->dctrl &= ~DC_FB_FORMAT;
-
-	switch (format) {
-	case DRM_FORMAT_ARGB8888:
-	case DRM_FORMAT_XRGB8888:
-		gdev->dctrl |= DC_RGB888;
-		break;
-	case DRM_FORMAT_RGB565:
-		gdev->dctrl |= DC_RGB565;
-		break;
-	default:
-		pci_err(dev->pdev, "Unhandled pixel format 0x%08x\n", format);
-		return -EINVAL;
-	}
-
 	hdisplay = HVDISPLAY(mode->hdisplay, mode->htotal);
 	vdisplay = HVDISPLAY(mode->vdisplay, mode->vtotal);
 	hsync = HVSYNC(mode->hsync_start, mode->hsync_end);
@@ -338,189 +897,246 @@ static int gxmicro_crtc_mode_set(struct drm_crtc *crtc, struct drm_display_mode
 	if (mode->flags & DRM_MODE_FLAG_NVSYNC)
 		vsync |= HVSYNC_NEGTIVE;
 
-	gxmicro_write(gdev, DC_CTRL, gdev->dctrl);
-
-	gxmicro_write(gdev, DC_STRIDE, fb->pitches[0]);		/* Reserved: 切换分辨率可能 改变, fb->pitches[0] 无改变, hdisplay(mode->hdisplay) * bpc(fb->format->cpp[0]) */
-	gxmicro_write(gdev, DC_ORIGIN, 0);
-
-	gxmicro_write(gdev, DC_PANEL_CONF, PANEL_CONF);
+	gxmicro_write(gdev, DC_PANEL_CONF(pipe), PANEL_CONF);
 
 	/* HDisplay & HSync */
-	gxmicro_write(gdev, DC_HDISPLAY, hdisplay);
-	gxmicro_write(gdev, DC_HSYNC, hsync);
+	gxmicro_write(gdev, DC_HDISPLAY(pipe), hdisplay);
+	gxmicro_write(gdev, DC_HSYNC(pipe), hsync);
 
 	/* VDisplay & VSync */
-	gxmicro_write(gdev, DC_VDISPLAY, vdisplay);
-	gxmicro_write(gdev, DC_VSYNC, vsync);
+	gxmicro_write(gdev, DC_VDISPLAY(pipe), vdisplay);
+	gxmicro_write(gdev, DC_VSYNC(pipe), vsync);
 
-	gxmicro_crtc_mode_set_base(crtc, x, y, ofb);
-
-	pci_dbg(dev->pdev, "Framebuffer format: 0x%08x, mode: \"%s\". "
-		"Display Controller Reg: \"dc ctrl: 0x%08x, stride: 0x%08x, panel: 0x%08lx, "
+	pci_dbg(dev->pdev, "Pipe %u Mode: \"%s\". Display Controller Reg: \"panel: 0x%08lx, "
 		"hdisplay: 0x%08x, hsync: 0x%08x, vdisplay: 0x%08x, vsync: 0x%08x\"\n",
-		format, mode->name, gdev->dctrl, fb->pitches[0], PANEL_CONF, hdisplay, hsync, vdisplay, vsync);
+		pipe, mode->name, PANEL_CONF, hdisplay, hsync, vdisplay, vsync);
 
-	return 0;
+	/* 编码器在下一帧重新配置 */
+	if (pipe == jpeg_pipe)
+		gxmicro_jpeg_mode_set(gdev);
 }
 
-static void gxmicro_crtc_disable(struct drm_crtc *crtc)
+static void gxmicro_crtc_atomic_enable(struct drm_crtc *crtc, struct drm_crtc_state *old_state)
 {
-	struct drm_plane *primary = crtc->primary;
-	struct drm_gem_vram_object *gbo;
+	struct drm_device *dev = crtc->dev;
+	struct gxmicro_dc_dev *gdev = drm_get_priv(dev);
+	uint32_t pipe = gxmicro_crtc_pipe(crtc);
 
-	gxmicro_crtc_dpms(crtc, DRM_MODE_DPMS_OFF);
+	gxmicro_update_bits(gdev, DC_CTRL(pipe), DC_ENABLE, DC_ENABLE);
 
-	if (primary->fb) {
-		gbo = drm_gem_vram_of_gem(primary->fb->obj[0]);
-		drm_gem_vram_unpin(gbo);
-	}
+	drm_crtc_vblank_on(crtc);
+
+	pci_dbg(dev->pdev, "Enabled Display Controller %u, dc ctrl: 0x%08x\n", pipe, gxmicro_read(gdev, DC_CTRL(pipe)));
+}
+
+static void gxmicro_crtc_atomic_disable(struct drm_crtc *crtc, struct drm_crtc_state *old_state)
+{
+	struct drm_device *dev = crtc->dev;
+	struct gxmicro_dc_dev *gdev = drm_get_priv(dev);
+	uint32_t pipe = gxmicro_crtc_pipe(crtc);
+
+	if (pipe == 0)
+		gxmicro_cursor_vblank(gdev);
+
+	gxmicro_gamma_vblank(gdev, pipe);
+
+	drm_crtc_vblank_off(crtc);
+
+	if (pipe == jpeg_pipe)
+		gxmicro_scanout_update(gdev, NULL, 0);
+
+	gxmicro_update_bits(gdev, DC_CTRL(pipe), DC_ENABLE, 0);
 
-	primary->fb = NULL;
+	/* 软复位, 下次 modeset 重新写入时序, 地址和 Gamma 表 */
+	gxmicro_shadow_invalidate_pipe(gdev, pipe);
+	gxmicro_gamma_invalidate(gdev, pipe);
+	WRITE_ONCE(gdev->fb_index[pipe], -1);
+
+	pci_dbg(dev->pdev, "Disabled Display Controller %u, dc ctrl: 0x%08x\n", pipe, gxmicro_read(gdev, DC_CTRL(pipe)));
 }
 
-static void gxmicro_crtc_reset(struct drm_crtc *crtc)
+static int gxmicro_crtc_atomic_check(struct drm_crtc *crtc, struct drm_crtc_state *state)
 {
+	if (state->color_mgmt_changed && state->gamma_lut &&
+			drm_color_lut_size(state->gamma_lut) != GAMMA_SIZE)
+		return -EINVAL;
 
+	return 0;
 }
 
-#if 0	/* 非必须, 未测试, 当前无法读 Gamma 相关寄存器 */
-static int gxmicro_crtc_gamma_set(struct drm_crtc *crtc,
-				uint16_t *r, uint16_t *g, uint16_t *b,
-				uint32_t size, struct drm_modeset_acquire_ctx *ctx)
+static void gxmicro_crtc_atomic_flush(struct drm_crtc *crtc, struct drm_crtc_state *old_state)
 {
 	struct drm_device *dev = crtc->dev;
-	struct gxmicro_dc_dev *gdev = drm_get_priv(dev);
-	uint32_t gamma = 0;
-	int i = 0;
+	struct drm_pending_vblank_event *event = crtc->state->event;
 
-	gxmicro_write(gdev, DC_GAMMA_INDEX, 0);
+	gxmicro_gamma_commit(drm_get_priv(dev), crtc);
 
-	for (i = 0; i < GAMMA_SIZE; i++) {
-		gamma = GAMMA_DATA(r[i], g[i], b[i]);
+	if (!event)
+		return;
 
-		gxmicro_write(gdev, DC_GAMMA_DATA, gamma);
+	crtc->state->event = NULL;
 
-		pci_dbg(dev->pdev, "r/g/b = 0x%04x / 0x%04x / 0x%04x, "
-				"gamma data 0x%08x\n", r[i], g[i], b[i], gamma);	/* 验证成功后可去除 */
-	}
+	/* Crtc 关闭时无 vblank 中断, 直接完成 event */
+	spin_lock_irq(&dev->event_lock);
+	if (drm_crtc_vblank_get(crtc) == 0)
+		drm_crtc_arm_vblank_event(crtc, event);
+	else
+		drm_crtc_send_vblank_event(crtc, event);
+	spin_unlock_irq(&dev->event_lock);
+}
+
+static int gxmicro_crtc_enable_vblank(struct drm_crtc *crtc)
+{
+	struct gxmicro_dc_dev *gdev = drm_get_priv(crtc->dev);
+	uint32_t vsync = DC_INT_VSYNC(gxmicro_crtc_pipe(crtc));
+
+	gxmicro_update_bits(gdev, DC_INTERRUPT_ENABLE, vsync, vsync);
 
 	return 0;
 }
-#endif
+
+static void gxmicro_crtc_disable_vblank(struct drm_crtc *crtc)
+{
+	struct gxmicro_dc_dev *gdev = drm_get_priv(crtc->dev);
+
+	gxmicro_update_bits(gdev, DC_INTERRUPT_ENABLE, DC_INT_VSYNC(gxmicro_crtc_pipe(crtc)), 0);
+}
 
 static const struct drm_crtc_funcs gxmicro_crtc_funcs = {
+	.reset = drm_atomic_helper_crtc_reset,
 	.destroy = drm_crtc_cleanup,
-	.set_config = drm_crtc_helper_set_config,
-	.reset = gxmicro_crtc_reset,
-#if 0	/* 非必须, 未测试, 当前无法读 Gamma 相关寄存器 */
-	.gamma_set = gxmicro_crtc_gamma_set,
-#endif
+	.set_config = drm_atomic_helper_set_config,
+	.page_flip = drm_atomic_helper_page_flip,
+	.atomic_duplicate_state = drm_atomic_helper_crtc_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_crtc_destroy_state,
+	.enable_vblank = gxmicro_crtc_enable_vblank,
+	.disable_vblank = gxmicro_crtc_disable_vblank,
+	.gamma_set = drm_atomic_helper_legacy_gamma_set,
 };
 
 static const struct drm_crtc_helper_funcs gxmicro_crtc_helper_funcs = {
-	.dpms = gxmicro_crtc_dpms,
-	.prepare = gxmicro_crtc_prepare,
-	.commit = gxmicro_crtc_commit,
-	.mode_set = gxmicro_crtc_mode_set,
-	.mode_set_base = gxmicro_crtc_mode_set_base,
-	.disable = gxmicro_crtc_disable,
+	.mode_set_nofb = gxmicro_crtc_mode_set_nofb,
+	.atomic_check = gxmicro_crtc_atomic_check,
+	.atomic_enable = gxmicro_crtc_atomic_enable,
+	.atomic_disable = gxmicro_crtc_atomic_disable,
+	.atomic_flush = gxmicro_crtc_atomic_flush,
 };
 
-static int gxmicro_crtc_init(struct gxmicro_dc_dev *gdev)
+static int gxmicro_crtc_init(struct gxmicro_dc_dev *gdev, uint32_t pipe)
 {
 	struct drm_device *dev = gdev->dev;
-	struct drm_plane *primary = gdev->primary;
-	struct drm_plane *cursor = &gdev->cursor;
-	struct drm_crtc *crtc = &gdev->crtc;
+	struct drm_plane *primary = &gdev->primary[pipe];
+	struct drm_plane *cursor = pipe == 0 ? &gdev->cursor : NULL;
+	struct drm_crtc *crtc = &gdev->crtc[pipe];
 	int ret = 0;
 
-	ret = drm_crtc_init_with_planes(dev, crtc, primary, cursor, &gxmicro_crtc_funcs, NULL);
+	ret = drm_crtc_init_with_planes(dev, crtc, primary, cursor, &gxmicro_crtc_funcs, "crtc-%u", pipe);
 	if (ret) {
-		pci_err(dev->pdev, "Failed to init Crtc\n");
+		pci_err(dev->pdev, "Failed to init Crtc %u\n", pipe);
 		return ret;
 	}
 
 	drm_crtc_helper_add(crtc, &gxmicro_crtc_helper_funcs);
-#if 0	/* 非必须, 未测试, 当前无法读 Gamma 相关寄存器 */
-	drm_mode_crtc_set_gamma_size(crtc, GAMMA_SIZE);
-#endif
-	return 0;
-}
-
-/* ****************************** Encoder ****************************** */
-
-static void gxmicro_encoder_dpms(struct drm_encoder *encoder, int mode)
-{
 
-}
-
-static void gxmicro_encoder_prepare(struct drm_encoder *encoder)
-{
+	gdev->fb_index[pipe] = -1;
 
-}
-
-static void gxmicro_encoder_commit(struct drm_encoder *encoder)
-{
+	/* GAMMA_LUT, legacy gamma 由 helper 转换 */
+	drm_mode_crtc_set_gamma_size(crtc, GAMMA_SIZE);
+	drm_crtc_enable_color_mgmt(crtc, 0, false, GAMMA_SIZE);
 
+	return 0;
 }
 
-static void gxmicro_encoder_mode_set(struct drm_encoder *encoder,
-			struct drm_display_mode *mode, struct drm_display_mode *adjusted_mode)
-{
-
-}
+/* ****************************** Encoder ****************************** */
 
 static const struct drm_encoder_funcs gxmicro_encoder_funcs = {
 	.destroy = drm_encoder_cleanup,
 };
 
-static const struct drm_encoder_helper_funcs gxmicro_encoder_helper_funcs = {
-	.dpms = gxmicro_encoder_dpms,
-	.prepare = gxmicro_encoder_prepare,
-	.commit = gxmicro_encoder_commit,
-	.mode_set = gxmicro_encoder_mode_set,
-};
-
-static int gxmicro_encoder_init(struct gxmicro_dc_dev *gdev)
+static int gxmicro_encoder_init(struct gxmicro_dc_dev *gdev, uint32_t pipe)
 {
 	struct drm_device *dev = gdev->dev;
-	struct drm_crtc *crtc = &gdev->crtc;
-	struct drm_encoder *encoder = &gdev->encoder;
+	struct drm_crtc *crtc = &gdev->crtc[pipe];
+	struct drm_encoder *encoder = &gdev->encoder[pipe];
 	int ret = 0;
 
-	ret = drm_encoder_init(dev, encoder, &gxmicro_encoder_funcs, DRM_MODE_ENCODER_DAC, NULL);
+	ret = drm_encoder_init(dev, encoder, &gxmicro_encoder_funcs,
+				pipe == 0 ? DRM_MODE_ENCODER_DAC : DRM_MODE_ENCODER_VIRTUAL, "encoder-%u", pipe);
 	if (ret) {
-		pci_err(dev->pdev, "Failed to init Encoder\n");
+		pci_err(dev->pdev, "Failed to init Encoder %u\n", pipe);
 		return ret;
 	}
 
 	encoder->possible_crtcs = drm_crtc_mask(crtc);
 
-	drm_encoder_helper_add(encoder, &gxmicro_encoder_helper_funcs);
-
 	return 0;
 }
 
 /* ****************************** Connector ****************************** */
 
+static bool edid_cache = true;
+module_param(edid_cache, bool, 0644);
+MODULE_PARM_DESC(edid_cache, "Reuse cached EDID when header and checksum are unchanged (default true)");
+
+#define EDID_ID_SIZE	18	/* header, vendor & product, serial, week & year */
+
+static int gxmicro_ddc_read(struct i2c_adapter *adap, uint8_t offset, uint8_t *buf, uint16_t len)
+{
+	struct i2c_msg msgs[] = {
+		{ .addr = DDC_ADDR, .flags = 0, .len = 1, .buf = &offset, },
+		{ .addr = DDC_ADDR, .flags = I2C_M_RD, .len = len, .buf = buf, },
+	};
+
+	return i2c_transfer(adap, msgs, ARRAY_SIZE(msgs)) == ARRAY_SIZE(msgs) ? 0 : -EIO;
+}
+
+/* 只读取 EDID 头部和校验和 (19 字节), 与缓存比较, 避免每次读取完整 EDID */
+static bool gxmicro_edid_unchanged(struct gxmicro_dc_dev *gdev)
+{
+	const uint8_t *cached = (const uint8_t *)gdev->edid;
+	uint8_t id[EDID_ID_SIZE];
+	uint8_t checksum;
+
+	if (gxmicro_ddc_read(&gdev->adap, 0, id, sizeof(id)))
+		return false;
+
+	if (gxmicro_ddc_read(&gdev->adap, EDID_LENGTH - 1, &checksum, 1))
+		return false;
+
+	return !memcmp(id, cached, sizeof(id)) && checksum == gdev->edid->checksum;
+}
+
 static int gxmicro_connector_get_modes(struct drm_connector *connector)
 {
 	struct drm_device *dev = connector->dev;
 	struct gxmicro_dc_dev *gdev = drm_get_priv(dev);
-	struct edid *edid;
-	int count = 0;
+	ktime_t start;
+
+	if (!edid_cache || !gdev->edid || !gxmicro_edid_unchanged(gdev)) {
+		kfree(gdev->edid);
 
-	edid = drm_get_edid(connector, &gdev->adap);
-	if (!edid) {
-		pci_err(dev->pdev, "Failed to get edid\n");
-		return -ENODEV;
+		start = ktime_get();
+
+		gdev->edid = drm_get_edid(connector, &gdev->adap);
+		if (!gdev->edid) {
+			pci_err(dev->pdev, "Failed to get edid\n");
+			return -ENODEV;
+		}
+
+		pci_dbg(dev->pdev, "EDID read %d blocks in %lld us\n",
+				gdev->edid->extensions + 1, ktime_us_delta(ktime_get(), start));
 	}
 
-	drm_connector_update_edid_property(connector, edid);
-	count = drm_add_edid_modes(connector, edid);
-	kfree(edid);
+	drm_connector_update_edid_property(connector, gdev->edid);
 
-	return count;
+	return drm_add_edid_modes(connector, gdev->edid);
+}
+
+static enum drm_connector_status gxmicro_connector_detect(struct drm_connector *connector, bool force)
+{
+	struct gxmicro_dc_dev *gdev = drm_get_priv(connector->dev);
+
+	return drm_probe_ddc(&gdev->adap) ? connector_status_connected : connector_status_disconnected;
 }
 
 static enum drm_mode_status gxmicro_connector_mode_valid(struct drm_connector *connector, struct drm_display_mode *mode)
@@ -532,13 +1148,41 @@ static struct drm_encoder *gxmicro_connector_best_single_encoder(struct drm_conn
 {
 	struct gxmicro_dc_dev *gdev = drm_get_priv(connector->dev);
 
-	return &gdev->encoder;
+	return &gdev->encoder[connector - gdev->connector];
+}
+
+/*
+ * pipe 1 没有显示器, 默认报告未连接, 避免 fbdev 和桌面扩展到不存在的输出
+ * 由 virtual_head 或 video=Virtual-1:e 启用
+ */
+static bool virtual_head;
+module_param(virtual_head, bool, 0444);
+MODULE_PARM_DESC(virtual_head, "Report the pipe 1 virtual connector as connected (default false)");
+
+/* 提供不超过 DISPLAY_WIDTH * DISPLAY_HEIGHT 的标准 modes */
+static int gxmicro_virtual_get_modes(struct drm_connector *connector)
+{
+	int count;
+
+	count = drm_add_modes_noedid(connector, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+	drm_set_preferred_mode(connector, 1024, 768);
+
+	return count;
+}
+
+/* connector->force 时不调用 */
+static enum drm_connector_status gxmicro_virtual_detect(struct drm_connector *connector, bool force)
+{
+	return virtual_head ? connector_status_connected : connector_status_disconnected;
 }
 
 static const struct drm_connector_funcs gxmicro_connector_funcs = {
-	.dpms = drm_helper_connector_dpms,
+	.reset = drm_atomic_helper_connector_reset,
+	.detect = gxmicro_connector_detect,
 	.fill_modes = drm_helper_probe_single_connector_modes,
 	.destroy = drm_connector_cleanup,
+	.atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
 };
 
 static const struct drm_connector_helper_funcs gxmicro_connector_helper_funcs = {
@@ -547,59 +1191,194 @@ static const struct drm_connector_helper_funcs gxmicro_connector_helper_funcs =
 	.best_encoder = gxmicro_connector_best_single_encoder,
 };
 
-static int gxmicro_connector_init(struct gxmicro_dc_dev *gdev)
+static const struct drm_connector_funcs gxmicro_virtual_funcs = {
+	.reset = drm_atomic_helper_connector_reset,
+	.detect = gxmicro_virtual_detect,
+	.fill_modes = drm_helper_probe_single_connector_modes,
+	.destroy = drm_connector_cleanup,
+	.atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
+	.atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
+};
+
+static const struct drm_connector_helper_funcs gxmicro_virtual_helper_funcs = {
+	.get_modes = gxmicro_virtual_get_modes,
+	.mode_valid = gxmicro_connector_mode_valid,
+	.best_encoder = gxmicro_connector_best_single_encoder,
+};
+
+static int gxmicro_connector_init(struct gxmicro_dc_dev *gdev, uint32_t pipe)
 {
 	struct drm_device *dev = gdev->dev;
-	struct drm_encoder *encoder = &gdev->encoder;
-	struct drm_connector *connector = &gdev->connector;
+	struct drm_encoder *encoder = &gdev->encoder[pipe];
+	struct drm_connector *connector = &gdev->connector[pipe];
 	int ret = 0;
 
-	ret = drm_connector_init(dev, connector, &gxmicro_connector_funcs, DRM_MODE_CONNECTOR_VGA);
+	if (pipe == 0)
+		ret = drm_connector_init(dev, connector, &gxmicro_connector_funcs, DRM_MODE_CONNECTOR_VGA);
+	else
+		ret = drm_connector_init(dev, connector, &gxmicro_virtual_funcs, DRM_MODE_CONNECTOR_VIRTUAL);
 	if (ret) {
-		pci_err(dev->pdev, "Failed to init Connector\n");
+		pci_err(dev->pdev, "Failed to init Connector %u\n", pipe);
 		return ret;
 	}
 
-	drm_connector_helper_add(connector, &gxmicro_connector_helper_funcs);
-
-	connector->polled = 0;
+	if (pipe == 0) {
+		drm_connector_helper_add(connector, &gxmicro_connector_helper_funcs);
+		/* 不使用 drm_kms_helper_poll, 由 gxmicro_hpd_work 检测 */
+	} else {
+		drm_connector_helper_add(connector, &gxmicro_virtual_helper_funcs);
+	}
 
 	drm_connector_attach_encoder(connector, encoder);
 
 	return 0;
 }
 
+/* ****************************** Hotplug ****************************** */
+
+static unsigned int hpd_poll_ms = 2000;
+module_param(hpd_poll_ms, uint, 0444);
+MODULE_PARM_DESC(hpd_poll_ms, "Monitor hotplug poll interval in ms, 0 to disable (default 2000)");
+
+/*
+ * encoder 没有 HPD 中断, 定时通过 DDC 读 1 字节检测显示器 (drm_probe_ddc),
+ * 状态改变时才丢弃 EDID 缓存并通知用户空间重新获取 modes
+ */
+static void gxmicro_hpd_work(struct work_struct *work)
+{
+	struct gxmicro_dc_dev *gdev = container_of(to_delayed_work(work), struct gxmicro_dc_dev, hpd_work);
+	struct drm_device *dev = gdev->dev;
+	enum drm_connector_status status;
+	enum drm_connector_status old_status = gdev->hpd_status;
+
+	status = drm_probe_ddc(&gdev->adap) ? connector_status_connected : connector_status_disconnected;
+
+	if (status != old_status) {
+		gdev->hpd_status = status;
+
+		mutex_lock(&dev->mode_config.mutex);
+		kfree(gdev->edid);
+		gdev->edid = NULL;
+		mutex_unlock(&dev->mode_config.mutex);
+
+		pci_dbg(dev->pdev, "Connector %s\n",
+				status == connector_status_connected ? "connected" : "disconnected");
+
+		if (old_status != connector_status_unknown)
+			drm_kms_helper_hotplug_event(dev);
+	}
+
+	schedule_delayed_work(&gdev->hpd_work, msecs_to_jiffies(hpd_poll_ms));
+}
+
+static void gxmicro_hpd_init(struct gxmicro_dc_dev *gdev)
+{
+	gdev->hpd_status = connector_status_unknown;
+
+	INIT_DELAYED_WORK(&gdev->hpd_work, gxmicro_hpd_work);
+}
+
+/* drm_dev_register 之后开始, drm_dev_unregister 之前停止, 只对已注册的设备发送 hotplug 事件 */
+void gxmicro_kms_hpd_enable(struct gxmicro_dc_dev *gdev)
+{
+	if (hpd_poll_ms)
+		schedule_delayed_work(&gdev->hpd_work, msecs_to_jiffies(hpd_poll_ms));
+}
+
+void gxmicro_kms_hpd_disable(struct gxmicro_dc_dev *gdev)
+{
+	cancel_delayed_work_sync(&gdev->hpd_work);
+}
+
+/* ****************************** Interrupt ****************************** */
+
+irqreturn_t gxmicro_kms_irq_handler(struct gxmicro_dc_dev *gdev)
+{
+	uint32_t status;
+	uint32_t pipe;
+
+	/* 共享中断, 只处理已使能的中断 */
+	status = gxmicro_read(gdev, DC_INTERRUPT) & gxmicro_read(gdev, DC_INTERRUPT_ENABLE);
+	if (!status)
+		return IRQ_NONE;
+
+	gxmicro_write(gdev, DC_INTERRUPT, status);
+
+	for (pipe = 0; pipe < DC_PIPES; pipe++) {
+		if (!(status & DC_INT_VSYNC(pipe)))
+			continue;
+
+		/* 一帧结束后才可正常读取, 同步当前扫描的地址寄存器 */
+		WRITE_ONCE(gdev->fb_index[pipe], !!(__gxmicro_read(gdev, DC_CTRL(pipe)) & DC_FB_INDEX));
+
+		if (pipe == 0)
+			gxmicro_cursor_vblank(gdev);
+
+		gxmicro_gamma_vblank(gdev, pipe);
+
+		/* page flip 在此帧边界生效, 完成 atomic_flush 中 arm 的 event */
+		drm_crtc_handle_vblank(&gdev->crtc[pipe]);
+	}
+
+	return IRQ_HANDLED;
+}
+
 /* ****************************** KMS Init & Fini ****************************** */
 
 int gxmicro_kms_init(struct gxmicro_dc_dev *gdev)
 {
 	struct drm_device *dev = gdev->dev;
+	uint32_t pipe;
 	int ret;
 
+	if (jpeg_pipe >= DC_PIPES) {
+		pci_warn(dev->pdev, "Invalid jpeg_pipe %u, use pipe 0\n", jpeg_pipe);
+		jpeg_pipe = 0;
+	}
+
 	gxmicro_setup_mode_config(gdev);
 
-	ret = gxmicro_primary_plane_init(gdev);
-	if (ret)
+	spin_lock_init(&gdev->damage_lock);
+	spin_lock_init(&gdev->cursor_lock);
+	spin_lock_init(&gdev->scanout_lock);
+	mutex_init(&gdev->scanout_mutex);
+	spin_lock_init(&gdev->gamma_lock);
+
+	ret = drm_vblank_init(dev, DC_PIPES);
+	if (ret) {
+		pci_err(dev->pdev, "Failed to init vblank\n");
 		goto err_kms_init;
+	}
+
+	/* 中断在 gxmicro_pcie_init 中申请, 未使用 drm_irq_install */
+	dev->irq_enabled = true;
 
 	ret = gxmicro_cursor_plane_init(gdev);
 	if (ret)
 		goto err_kms_init;
 
-	ret = gxmicro_crtc_init(gdev);
-	if (ret)
-		goto err_kms_init;
+	for (pipe = 0; pipe < DC_PIPES; pipe++) {
+		ret = gxmicro_primary_plane_init(gdev, pipe);
+		if (ret)
+			goto err_kms_init;
 
-	ret = gxmicro_encoder_init(gdev);
-	if (ret)
-		goto err_kms_init;
+		ret = gxmicro_crtc_init(gdev, pipe);
+		if (ret)
+			goto err_kms_init;
 
-	ret = gxmicro_connector_init(gdev);
-	if (ret)
-		goto err_kms_init;
+		ret = gxmicro_encoder_init(gdev, pipe);
+		if (ret)
+			goto err_kms_init;
+
+		ret = gxmicro_connector_init(gdev, pipe);
+		if (ret)
+			goto err_kms_init;
+	}
 
 	drm_mode_config_reset(dev);
 
+	gxmicro_hpd_init(gdev);
+
 	return 0;
 
 err_kms_init:
@@ -611,5 +1390,12 @@ void gxmicro_kms_fini(struct gxmicro_dc_dev *gdev)
 {
 	struct drm_device *dev = gdev->dev;
 
+	gxmicro_kms_hpd_disable(gdev);
+
+	/* drm_atomic_helper_shutdown 释放的 scanout pin */
+	flush_scheduled_work();
+
 	drm_mode_config_cleanup(dev);
+
+	kfree(gdev->edid);
 }
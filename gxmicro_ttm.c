@@ -8,25 +8,190 @@
  * 	Zheng DongXiong <zhengdongxiong@gxmicro.cn>
  */
 #include <drm/drm_vram_mm_helper.h>
+#include <drm/drm_prime.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-resv.h>
 
 #include "gxmicro_dc.h"
 
-#define GXMICRO_FB_BAR		0
-#define GXMICRO_FB_SIZE		SZ_8M
+/* ****************************** PRIME ****************************** */
+
+/*
+ * 导出: VRAM 通过 BAR 映射, 只支持 CPU 访问 (vmap, mmap), 其它设备不能 attach
+ * 导入: 创建相同大小的 VRAM 对象, 扫描前由 CPU 复制 (gxmicro_gem_prime_copy)
+ */
+void gxmicro_gem_free_object(struct drm_gem_object *obj)
+{
+	if (obj->import_attach)
+		drm_prime_gem_destroy(obj, NULL);
+
+	drm_gem_vram_driver_gem_free_object_unlocked(obj);
+}
+
+/*
+ * 只在 drm_gem_map_attach 中调用, BAR 不能作为其它设备的 DMA 地址, 拒绝 attach
+ * 	不提供 unpin 和 get_sg_table, attach 失败后不会调用
+ * 	vmap 自行 pin, 不经过此函数
+ */
+int gxmicro_gem_prime_pin(struct drm_gem_object *obj)
+{
+	return -EOPNOTSUPP;
+}
+
+void *gxmicro_gem_prime_vmap(struct drm_gem_object *obj)
+{
+	struct drm_gem_vram_object *gbo = drm_gem_vram_of_gem(obj);
+	void *vaddr;
+	int ret;
+
+	ret = drm_gem_vram_pin(gbo, 0);
+	if (ret)
+		return NULL;
+
+	vaddr = drm_gem_vram_kmap(gbo, true, NULL);
+	if (IS_ERR(vaddr)) {
+		drm_gem_vram_unpin(gbo);
+		return NULL;
+	}
+
+	return vaddr;
+}
+
+void gxmicro_gem_prime_vunmap(struct drm_gem_object *obj, void *vaddr)
+{
+	struct drm_gem_vram_object *gbo = drm_gem_vram_of_gem(obj);
+
+	drm_gem_vram_kunmap(gbo);
+	drm_gem_vram_unpin(gbo);
+}
+
+struct drm_gem_object *gxmicro_gem_prime_import(struct drm_device *dev, struct dma_buf *dma_buf)
+{
+	struct drm_gem_object *obj = dma_buf->priv;
+	struct dma_buf_attachment *attach;
+	struct drm_gem_vram_object *gbo;
+
+	/* 本设备导出, drm_gem_prime_dmabuf_ops 未导出, 比较 release */
+	if (dma_buf->ops->release == drm_gem_dmabuf_release && obj->dev == dev) {
+		drm_gem_object_get(obj);
+		return obj;
+	}
+
+	attach = dma_buf_attach(dma_buf, dev->dev);
+	if (IS_ERR(attach))
+		return ERR_CAST(attach);
+
+	gbo = drm_gem_vram_create(dev, &dev->vram_mm->bdev, dma_buf->size, 0, false);
+	if (IS_ERR(gbo)) {
+		dma_buf_detach(dma_buf, attach);
+		return ERR_CAST(gbo);
+	}
+
+	/* drm_prime_gem_destroy 中释放 */
+	get_dma_buf(dma_buf);
+	gbo->bo.base.import_attach = attach;
+
+	return &gbo->bo.base;
+}
+
+/* prepare_fb 中调用, 已 pin 到 VRAM, 复制 rect 所在的行 */
+int gxmicro_gem_prime_copy(struct drm_framebuffer *fb, const struct drm_rect *rect)
+{
+	struct drm_gem_object *obj = fb->obj[0];
+	struct dma_buf *dma_buf = obj->import_attach->dmabuf;
+	struct drm_gem_vram_object *gbo = drm_gem_vram_of_gem(obj);
+	uint32_t cpp = fb->format->cpp[0];
+	size_t len = drm_rect_width(rect) * cpp;
+	void __iomem *dst;
+	size_t offset;
+	void *src;
+	long lret;
+	int y;
+	int ret;
+
+	/* begin_cpu_access 不一定等待 exporter 渲染完成, 等待写入的 fence */
+	lret = dma_resv_wait_timeout_rcu(dma_buf->resv, false, true, MAX_SCHEDULE_TIMEOUT);
+	if (lret < 0)
+		return lret;
+
+	ret = dma_buf_begin_cpu_access(dma_buf, DMA_FROM_DEVICE);
+	if (ret)
+		return ret;
+
+	src = dma_buf_vmap(dma_buf);
+	if (!src) {
+		ret = -ENOMEM;
+		goto err_vmap;
+	}
+
+	dst = (void __iomem *)drm_gem_vram_kmap(gbo, true, NULL);
+	if (IS_ERR(dst)) {
+		ret = PTR_ERR(dst);
+		goto err_kmap;
+	}
+
+	for (y = rect->y1; y < rect->y2; y++) {
+		offset = fb->offsets[0] + y * fb->pitches[0] + rect->x1 * cpp;
+		memcpy_toio(dst + offset, src + offset, len);
+	}
+
+	drm_gem_vram_kunmap(gbo);
+err_kmap:
+	dma_buf_vunmap(dma_buf, src);
+err_vmap:
+	dma_buf_end_cpu_access(dma_buf, DMA_FROM_DEVICE);
+	return ret;
+}
 
 int gxmicro_ttm_init(struct gxmicro_dc_dev *gdev)
 {
 	struct drm_device *dev = gdev->dev;
 	struct drm_vram_mm *vmm;
+	int ret;
+	resource_size_t size = pci_resource_len(dev->pdev, GXMICRO_FB_BAR);
+
+	if (size <= CURSOR_RESERVED) {
+		pci_err(dev->pdev, "VRAM too small: %pa\n", &size);
+		return -ENOMEM;
+	}
+
+	gdev->vram_base = pci_resource_start(dev->pdev, GXMICRO_FB_BAR);
+
+	/* 从 VRAM 末尾分配保留区 */
+	size -= CURSOR_RESERVED;
+	gdev->cursor_offset = size;
+
+	if (size >= JPEG_RESERVED + VRAM_FB_MIN_SIZE) {
+		size -= JPEG_RESERVED;
+		gdev->jpeg_offset = size;
+	} else {
+		pci_warn(dev->pdev, "VRAM too small, no JPEG bitstream buffers reserved\n");
+	}
+
+	gdev->vram_size = size;
+
+	gdev->cursor_vaddr = pci_iomap_wc_range(dev->pdev, GXMICRO_FB_BAR, gdev->cursor_offset, CURSOR_RESERVED);
+	if (!gdev->cursor_vaddr) {
+		pci_err(dev->pdev, "Failed to map Cursor\n");
+		return -ENOMEM;
+	}
 
-	vmm = drm_vram_helper_alloc_mm(dev, pci_resource_start(dev->pdev, GXMICRO_FB_BAR),
-				GXMICRO_FB_SIZE, &drm_gem_vram_mm_funcs);
+	vmm = drm_vram_helper_alloc_mm(dev, gdev->vram_base, gdev->vram_size, &drm_gem_vram_mm_funcs);
 	if (IS_ERR(vmm)) {
 		pci_err(dev->pdev, "Failed to init VRAM MM\n");
-		return PTR_ERR(vmm);
+		ret = PTR_ERR(vmm);
+		goto err_alloc_mm;
 	}
 
+	pci_info(dev->pdev, "VRAM %lluMiB, FrameBuffer %lluMiB, Cursor at 0x%llx, JPEG at 0x%llx\n",
+			(uint64_t)pci_resource_len(dev->pdev, GXMICRO_FB_BAR) >> 20, (uint64_t)gdev->vram_size >> 20,
+			(uint64_t)gdev->cursor_offset, (uint64_t)gdev->jpeg_offset);
+
 	return 0;
+
+err_alloc_mm:
+	pci_iounmap(dev->pdev, gdev->cursor_vaddr);
+	return ret;
 }
 
 void gxmicro_ttm_fini(struct gxmicro_dc_dev *gdev)
@@ -34,4 +199,6 @@ void gxmicro_ttm_fini(struct gxmicro_dc_dev *gdev)
 	struct drm_device *dev = gdev->dev;
 
 	drm_vram_helper_release_mm(dev);
+
+	pci_iounmap(dev->pdev, gdev->cursor_vaddr);
 }